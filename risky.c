@@ -1,5 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
 #include "mpc.h"
 
 #define LASSERT(args, cond, fmt, ...) \
@@ -8,15 +16,27 @@
   lval_del(args); return err; }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, ltype(args->cell[index]) == expect, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(ltype(args->cell[index])), ltype_name(expect))
+
+//Ranges are accepted wherever a list is read
+#define LASSERT_LIST(func, args, index) \
+  LASSERT(args, ltype(args->cell[index]) == LVAL_QEXPR \
+    || ltype(args->cell[index]) == LVAL_RANGE, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(ltype(args->cell[index])), ltype_name(LVAL_QEXPR))
 
 #define LASSERT_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
     "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
     func, args->count, num)
 
+#define LASSERT_NUM_BETWEEN(func, args, lo, hi) \
+  LASSERT(args, args->count >= lo && args->count <= hi, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i to %i.", \
+    func, args->count, lo, hi)
+
 #ifdef _WIN32
 #define SYS_NAME "Windows"
 #elif __linux__
@@ -65,33 +85,166 @@ mpc_parser_t* Risky;
 
 struct lval;
 struct lenv;
+struct lsym;
+struct lcells;
+struct lstr;
+struct lcode;
+struct lmemo;
+struct lvec;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lsym lsym;
+typedef struct lcells lcells;
+typedef struct lstr lstr;
+typedef struct lcode lcode;
+typedef struct lmemo lmemo;
+typedef struct lvec lvec;
 
-enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_RANGE, LVAL_VEC, LVAL_ENV, LVAL_FREE };
 
 enum { LERR_DIV_ZERO, LERR_MOD_ZERO, LERR_BAD_OP, LERR_BAD_NUM};
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+//Only the header and the payload of the node's type are allocated, so
+//fields of other types must never be touched. Nodes are reference counted
+//and shared, so a node with more than one reference must not be changed.
+//The one exception is the hints a symbol keeps, its slot and cache, which
+//are written in place whoever shares it.
 typedef struct lval {
-  int type;
+  unsigned char type;
+  unsigned char pool;
+  unsigned char mark;
+  int refs;
+
+  union {
+    //Basic
+    long num;
+    lstr* err;
+    lstr* str;
+    lvec* vec;
+
+    //Symbol, with the frame slot it was resolved to or -1. In the head
+    //of an expression it also caches the global function it named as of
+    //global version, without holding a reference to it. Both are hints
+    //that are checked before use, so a stale one only costs a lookup.
+    struct {
+      lsym* sym;
+      int slot;
+      unsigned version;
+      struct lval* cache;
+    };
+
+    //Function, with its body compiled for the vm once it has run there,
+    //and the table of its results if it is memoized
+    struct {
+      lbuiltin builtin;
+      lenv* env;
+      lval* formals;
+      lval* body;
+      lcode* code;
+      lmemo* memo;
+    };
+
+    //Expressions, a view of count cells inside a shared store
+    struct {
+      int count;
+      struct lval** cell;
+      lcells* store;
+    };
+
+    //Range, a list of length numbers from start on, step apart, that is
+    //only made into cells when a builtin needs them. Never empty.
+    struct {
+      long start;
+      long step;
+      long length;
+    };
+
+    //Free list link
+    struct lval* next;
+  };
+} lval;
 
-  //Basic
-  long num;
-  char* err;
-  char* sym;
-  char* str;
+//Environments are allocated like nodes and start with the same header.
+//Each call gets a frame of its own: the bindings of a partial
+//application are copied into it, followed by the arguments, in the order
+//of the function's formals, and bound counts how many formals it has
+//taken. par is the environment the call was made from. Bindings are kept
+//densely in syms/vals, which share one block with room for size of
+//each. Past LENV_LINEAR of them an open addressing index, keyed by
+//symbol hash, maps to their positions.
+struct lenv {
+  unsigned char type;
+  unsigned char pool;
+  unsigned char mark;
+  int refs;
 
-  //Function
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
+  lenv* par;
+  int count;
+  int size;
+  lsym** syms;
+  lval** vals;
+  int mask;
+  int bound;
+  int* index;
+};
 
+//Backing array of one or more expressions. The store owns a reference to
+//each of its items, and views into it may start and end anywhere, which
+//makes head and tail O(1). Items may only be changed through a view that
+//has the store to itself. The value of the whole store evaluated as an
+//S-Expression may be cached by constant folding, along with the builtin
+//it calls and the global version it was last checked at.
+struct lcells {
+  int refs;
+  int pool;
   int count;
-  struct lval** cell;
-} lval;
+  int cap;
+  unsigned version;
+  lbuiltin fn;
+  lval* folded;
+  lval* items[];
+};
+
+//Text of strings and errors. Buffers are immutable and reference counted,
+//so any number of values can share one, and they know their own length.
+struct lstr {
+  int refs;
+  int len;
+  char data[];
+};
+
+//Numbers of a vector, packed. Like text, buffers are immutable and
+//reference counted.
+struct lvec {
+  int refs;
+  int len;
+  long data[];
+};
+
+//Every symbol name is interned once, so symbols compare by pointer
+struct lsym {
+  lsym* next;
+  unsigned long hash;
+  int len;
+  int local;
+  char name[];
+};
+
+//Numbers that fit in a pointer minus its low bit are stored in the lval*
+//itself with that bit set, and never reach the allocator
+#define LFIX(v) (((uintptr_t)(v)) & 1)
+#define LFIX_MIN (LONG_MIN >> 1)
+#define LFIX_MAX (LONG_MAX >> 1)
+
+int ltype(lval* v) {
+  return LFIX(v) ? LVAL_NUM : v->type;
+}
+
+long lnum(lval* v) {
+  return LFIX(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
 
 /** =================
 Beginning of Pre-defs
@@ -103,76 +256,456 @@ lval* builtin_eval(lenv* e, lval* a);
 lval* lval_copy(lval* v);
 lval* lval_err(char* fmt, ...);
 lval* builtin_list(lenv* e, lval* a);
+void lval_release(lval* v);
+void lval_sever(lval* v);
+void lcells_del(lcells* s);
+void lenv_release(lenv* e);
+void lenv_sever(lenv* e);
+lval* lval_move(lval* v, int pool);
+lval* lvm_run(lenv* e, lcode* code, lval* f);
+lcode* lvm_code(lval* f);
+int lval_slot(lval* formals, lsym* s);
+lcode* lcode_copy(lcode* c);
+void lcode_del(lcode* c);
+extern __thread int lvm_enabled;
+lval* builtin_if(lenv* e, lval* a);
+lval* lval_if_branch(lval* a);
+lval* lval_folded(lval* v);
+void lfold_move(lval* v, lval* x);
+lval* lval_eval_expr(lval* a);
+lval* lmemo_call(lenv* e, lval* f, lval* a);
+lval* lval_cached(lval* s);
+int lval_stack_low(void);
+lval* lval_stack_err(void);
+lval* lval_builtin(lenv* e, lbuiltin b, lval* a);
+int lval_ranges(lval* a);
+lval* lval_force_args(lval* a);
+lval* builtin_pmap(lenv* e, lval* a);
+lmemo* lmemo_copy(lmemo* m);
+void lmemo_del(lmemo* m);
+void lmemo_mark(lmemo* m);
+void lmemo_unref(lmemo* m);
 
 /** =================
 End of Pre-defs
 ===================== */
 
+/** =================
+Beginning of Allocator
+===================== */
+
+//Nodes come from per-size-class slabs. Each class owns a list of chunks
+//that are carved by bumping a pointer, and freed nodes are threaded onto
+//a free list for that class. Arenas are pools pushed on top of the heap
+//for the duration of one evaluation and released all at once.
+
+#define LPOOL_CLASSES 16
+#define LPOOL_GRAIN   8
+#define LPOOL_CHUNK   (64 * 1024)
+#define LPOOL_DEPTH   32
+
+typedef struct lchunk {
+  struct lchunk* next;
+  char* top;
+  char* end;
+} lchunk;
+
+typedef struct lslab {
+  lval* free;
+  lchunk* chunks;
+} lslab;
+
+typedef struct lpool {
+  lslab slabs[LPOOL_CLASSES];
+} lpool;
+
+//Pool 0 is the heap, everything above it is an arena. Each thread has
+//pools of its own.
+__thread lpool lval_pools[LPOOL_DEPTH];
+__thread int lval_depth = 0;
+__thread int lval_nesting = 0;
+__thread lchunk* lval_spare = NULL;
+
+//Set in pmap workers, which evaluate in arenas above lval_floor, the
+//depth of the thread that started them. Nodes at or below the floor
+//belong to that thread, which keeps them alive until the workers are
+//done, so workers use them without counting references to them.
+__thread int lval_worker = 0;
+__thread int lval_floor = -1;
+
+//Heap accounting read by the garbage collector
+long lgc_allocated = 0;
+long lgc_heap_bytes = 0;
+
+size_t lval_size(int type) {
+  switch(type) {
+    case LVAL_FUN: return offsetof(lval, memo) + sizeof(lmemo*);
+    case LVAL_SYM: return offsetof(lval, cache) + sizeof(lval*);
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: return offsetof(lval, store) + sizeof(lcells*);
+    case LVAL_RANGE: return offsetof(lval, length) + sizeof(long);
+    case LVAL_ENV: return sizeof(lenv);
+    default: return offsetof(lval, num) + sizeof(long);
+  }
+}
+
+int lval_class(int type) {
+  return (lval_size(type) + LPOOL_GRAIN - 1) / LPOOL_GRAIN - 1;
+}
+
+lchunk* lchunk_new(void) {
+  lchunk* c;
+  if(lval_spare) {
+    c = lval_spare;
+    lval_spare = c->next;
+  } else {
+    c = malloc(LPOOL_CHUNK);
+  }
+  c->next = NULL;
+  c->top = (char*)c + sizeof(lchunk);
+  c->end = (char*)c + LPOOL_CHUNK;
+  return c;
+}
+
+lval* lval_alloc(int type) {
+  int k = lval_class(type);
+  lslab* s = &lval_pools[lval_depth].slabs[k];
+  lval* v = s->free;
+
+  if(v) {
+    s->free = v->next;
+  } else {
+    size_t size = (k + 1) * LPOOL_GRAIN;
+    if(!s->chunks || s->chunks->top + size > s->chunks->end) {
+      lchunk* c = lchunk_new();
+      c->next = s->chunks;
+      s->chunks = c;
+    }
+    v = (lval*)s->chunks->top;
+    s->chunks->top += size;
+  }
+
+  if(lval_depth == 0) {
+    lgc_allocated += (k + 1) * LPOOL_GRAIN;
+    lgc_heap_bytes += (k + 1) * LPOOL_GRAIN;
+  }
+
+  v->type = type;
+  v->pool = lval_depth;
+  v->mark = 0;
+  v->refs = 1;
+  return v;
+}
+
+//Return a node to the free list of the pool it came from
+void lval_free(lval* v) {
+  int k = lval_class(v->type);
+  lslab* s = &lval_pools[v->pool].slabs[k];
+  if(v->pool == 0) { lgc_heap_bytes -= (k + 1) * LPOOL_GRAIN; }
+  v->type = LVAL_FREE;
+  v->next = s->free;
+  s->free = v;
+}
+
+void lval_arena_begin(void) {
+  lval_nesting++;
+  if(lval_nesting < LPOOL_DEPTH) { lval_depth = lval_nesting; }
+}
+
+//Drop every node allocated since the matching lval_arena_begin. Nodes still
+//live only give up what they hold outside the arena, since anything they
+//point to inside it goes away with it.
+void lval_arena_end(void) {
+  if(lval_nesting-- >= LPOOL_DEPTH) { return; }
+
+  lpool* p = &lval_pools[lval_depth];
+  for(int k = 0; k < LPOOL_CLASSES; k++) {
+    size_t size = (k + 1) * LPOOL_GRAIN;
+    lchunk* c = p->slabs[k].chunks;
+
+    while(c) {
+      lchunk* next = c->next;
+      for(char* n = (char*)c + sizeof(lchunk); n < c->top; n += size) {
+        lval* v = (lval*)n;
+        if(v->type != LVAL_FREE) { lval_sever(v); }
+      }
+      c->next = lval_spare;
+      lval_spare = c;
+      c = next;
+    }
+
+    p->slabs[k].chunks = NULL;
+    p->slabs[k].free = NULL;
+  }
+
+  lval_depth = lval_nesting < LPOOL_DEPTH ? lval_nesting : LPOOL_DEPTH - 1;
+}
+
+/** =================
+End of Allocator
+===================== */
+
+
+/** =================
+Beginning of Symbol Table
+===================== */
+
+lsym** lsym_table = NULL;
+int lsym_count = 0;
+int lsym_size = 0;
+
+//Interned "&" used to mark variable arguments in formals
+lsym* lsym_amp;
+lsym* lsym_if;
+
+unsigned long lsym_hash(char* s) {
+  unsigned long h = 14695981039346656037UL;
+  for(; *s; s++) {
+    h = (h ^ (unsigned char)*s) * 1099511628211UL;
+  }
+  return h;
+}
+
+lsym* lsym_intern_unlocked(char* s);
+
+#ifndef _WIN32
+pthread_mutex_t lsym_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//pmap workers may intern symbols, one at a time
+lsym* lsym_intern(char* s) {
+  if(!lval_worker) { return lsym_intern_unlocked(s); }
+  pthread_mutex_lock(&lsym_lock);
+  lsym* y = lsym_intern_unlocked(s);
+  pthread_mutex_unlock(&lsym_lock);
+  return y;
+}
+#else
+lsym* lsym_intern(char* s) {
+  return lsym_intern_unlocked(s);
+}
+#endif
+
+lsym* lsym_intern_unlocked(char* s) {
+  unsigned long h = lsym_hash(s);
+
+  if(lsym_size) {
+    for(lsym* y = lsym_table[h & (lsym_size - 1)]; y; y = y->next) {
+      if(y->hash == h && strcmp(y->name, s) == 0) { return y; }
+    }
+  }
+
+  if(lsym_count >= lsym_size / 2) {
+    int size = lsym_size ? lsym_size * 2 : 256;
+    lsym** table = calloc(size, sizeof(lsym*));
+    for(int i = 0; i < lsym_size; i++) {
+      lsym* y = lsym_table[i];
+      while(y) {
+        lsym* next = y->next;
+        y->next = table[y->hash & (size - 1)];
+        table[y->hash & (size - 1)] = y;
+        y = next;
+      }
+    }
+    free(lsym_table);
+    lsym_table = table;
+    lsym_size = size;
+  }
+
+  int len = strlen(s);
+  lsym* y = malloc(sizeof(lsym) + len + 1);
+  memcpy(y->name, s, len + 1);
+  y->len = len;
+  y->local = 0;
+  y->hash = h;
+  y->next = lsym_table[h & (lsym_size - 1)];
+  lsym_table[h & (lsym_size - 1)] = y;
+  lsym_count++;
+  return y;
+}
+
+void lsym_cleanup(void) {
+  for(int i = 0; i < lsym_size; i++) {
+    lsym* y = lsym_table[i];
+    while(y) {
+      lsym* next = y->next;
+      free(y);
+      y = next;
+    }
+  }
+  free(lsym_table);
+}
+
+/** =================
+End of Symbol Table
+===================== */
+
 
 /** =================
 Beginning of Enviroment Functions
 ===================== */
 
-struct lenv {
-lenv* par;
-  int count;
-  char** syms;
-  lval** vals;
-};
+//Frames hold a handful of bindings, where scanning beats hashing
+#define LENV_LINEAR 8
+
+//Bumped whenever a global binding is replaced or a symbol is first bound
+//outside it, which invalidates every call site caching a global value
+lenv* lenv_global = NULL;
+unsigned lenv_version = 1;
 
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = (lenv*)lval_alloc(LVAL_ENV);
   e->par = NULL;
   e->count = 0;
+  e->size = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->mask = 0;
+  e->bound = 0;
+  e->index = NULL;
   return e;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-  for(int i = 0; i < e->count; i++) {
-    if(strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+//Give e room for size bindings in all
+void lenv_reserve(lenv* e, int size) {
+  lsym** syms = malloc((sizeof(lsym*) + sizeof(lval*)) * size);
+  lval** vals = (lval**)(syms + size);
+  if(e->count) {
+    memcpy(syms, e->syms, sizeof(lsym*) * e->count);
+    memcpy(vals, e->vals, sizeof(lval*) * e->count);
+  }
+
+  free(e->syms);
+  e->syms = syms;
+  e->vals = vals;
+  e->size = size;
+}
+
+//Position of the binding for s, or -1
+int lenv_find(lenv* e, lsym* s) {
+  if(!e->index) {
+    for(int i = 0; i < e->count; i++) {
+      if(e->syms[i] == s) { return i; }
     }
+    return -1;
   }
 
-  if(e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound symbol '%s'", k->sym);
+  //Slots hold position + 1, so zero marks an empty one
+  for(unsigned long h = s->hash; ; h++) {
+    int i = e->index[h & e->mask];
+    if(i == 0) { return -1; }
+    if(e->syms[i-1] == s) { return i-1; }
+  }
+}
+
+void lenv_index_add(lenv* e, int i) {
+  unsigned long h = e->syms[i]->hash;
+  while(e->index[h & e->mask]) { h++; }
+  e->index[h & e->mask] = i + 1;
+}
+
+//Rebuild the index with room for twice the bindings
+void lenv_reindex(lenv* e) {
+  int slots = 16;
+  while(slots < e->count * 2) { slots *= 2; }
+
+  free(e->index);
+  e->index = calloc(slots, sizeof(int));
+  e->mask = slots - 1;
+  for(int i = 0; i < e->count; i++) { lenv_index_add(e, i); }
+}
+
+//Append a binding, which must not be in e already
+void lenv_push(lenv* e, lsym* s, lval* v) {
+  if(e->count == e->size) { lenv_reserve(e, e->size ? e->size * 2 : 2); }
+
+  int i = e->count++;
+  e->syms[i] = s;
+  e->vals[i] = v;
+  //Code compiled while s was only global may rely on that
+  //pmap workers may bind the same symbols at once
+  if(e != lenv_global && !__atomic_load_n(&s->local, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&s->local, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lenv_version, 1, __ATOMIC_RELAXED);
+  }
+
+  if(e->index && e->count * 2 <= e->mask + 1) {
+    lenv_index_add(e, i);
+  } else if(e->count > LENV_LINEAR) {
+    lenv_reindex(e);
+  }
+}
+
+//A symbol never bound outside the global environment is found through
+//its cache, anything else by walking up from e
+lval* lenv_get(lenv* e, lval* k) {
+  lval* g = lval_cached(k);
+  if(g) { return lval_copy(g); }
+
+  for(; e; e = e->par) {
+    int i = lenv_find(e, k->sym);
+    if(i >= 0) { return lval_copy(e->vals[i]); }
   }
+  return lval_err("Unbound symbol '%s'", k->sym->name);
 }
 
+//Another reference to e
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  if(e->pool > lval_floor) { e->refs++; }
+  return e;
+}
+
+//A reference to e that can be kept in the given pool, copying it out
+//of a younger arena if it has to
+lenv* lenv_move(lenv* e, int pool) {
+  if(e->pool <= pool) { return lenv_copy(e); }
+
+  int depth = lval_depth;
+  lval_depth = pool;
+  lenv* n = lenv_new();
+  lval_depth = depth;
+
   n->par = e->par;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
+  n->bound = e->bound;
+  if(e->count) { lenv_reserve(n, e->count); }
   for(int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+    lenv_push(n, e->syms[i], lval_move(e->vals[i], pool));
   }
   return n;
 }
 
+//Values are moved into the pool the environment lives in, so a
+//definition made during an arena evaluation outlives the arena
 void lenv_put(lenv* e, lval* k, lval* v) {
-  for(int i = 0; i < e->count; i++) {
-    if(strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+  int i = lenv_find(e, k->sym);
+  if(i >= 0) {
+    if(e == lenv_global) { lenv_version++; }
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_move(v, e->pool);
+    return;
   }
 
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  lenv_push(e, k->sym, lval_move(v, e->pool));
+}
+
+//Whether every binding in c, not counting its parents, is hidden by one
+//in e. A lookup that gets past e then never stops in c, so c can be
+//dropped from the chain of parents below e.
+int lenv_shadows(lenv* e, lenv* c) {
+  for(int i = 0; i < c->count; i++) {
+    if(lenv_find(e, c->syms[i]) < 0) { return 0; }
+  }
+  return 1;
+}
 
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
+//Whether every binding in c is hidden by one in the frames from e up to,
+//but not including, c
+int lenv_hidden(lenv* e, lenv* c) {
+  for(int i = 0; i < c->count; i++) {
+    lenv* b = e;
+    while(b != c && lenv_find(b, c->syms[i]) < 0) { b = b->par; }
+    if(b == c) { return 0; }
+  }
+  return 1;
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
@@ -181,13 +714,28 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 }
 
 void lenv_del(lenv* e) {
+  if(e->pool <= lval_floor || --e->refs > 0) { return; }
+
   for(int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
     lval_del(e->vals[i]);
   }
+  lenv_release(e);
+  lval_free((lval*)e);
+}
+
+//Free the binding arrays without touching the values bound in them
+void lenv_release(lenv* e) {
   free(e->syms);
-  free(e->vals);
-  free(e);
+  free(e->index);
+}
+
+//Tear down an environment whose arena is being released
+void lenv_sever(lenv* e) {
+  for(int i = 0; i < e->count; i++) {
+    lval* v = e->vals[i];
+    if(!LFIX(v) && v->pool < e->pool) { lval_del(v); }
+  }
+  lenv_release(e);
 }
 
 /** =================
@@ -203,194 +751,668 @@ char* ltype_name(int t) {
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_RANGE: return "Range";
+    case LVAL_VEC: return "Vector";
     default: return "Unknown";
 
   }
 }
 
+lstr* lstr_new(char* s, int len) {
+  lstr* b = malloc(sizeof(lstr) + len + 1);
+  b->refs = 1;
+  b->len = len;
+  memcpy(b->data, s, len);
+  b->data[len] = '\0';
+  return b;
+}
+
+lstr* lstr_copy(lstr* b) {
+  b->refs++;
+  return b;
+}
+
+//Text b of node v, shared when v belongs to this thread
+lstr* lstr_share(lval* v, lstr* b) {
+  if(v->pool <= lval_floor) { return lstr_new(b->data, b->len); }
+  return lstr_copy(b);
+}
+
+void lstr_del(lstr* b) {
+  if(--b->refs == 0) { free(b); }
+}
+
+lvec* lvec_new(int len) {
+  lvec* b = malloc(sizeof(lvec) + sizeof(long) * len);
+  b->refs = 1;
+  b->len = len;
+  return b;
+}
+
+void lvec_del(lvec* b) {
+  if(--b->refs == 0) { free(b); }
+}
+
+//Numbers of node v, shared when v belongs to this thread
+lvec* lvec_share(lval* v) {
+  if(v->pool <= lval_floor) {
+    lvec* b = lvec_new(v->vec->len);
+    memcpy(b->data, v->vec->data, sizeof(long) * b->len);
+    return b;
+  }
+  v->vec->refs++;
+  return v->vec;
+}
+
+lval* lval_vec(lvec* b) {
+  lval* v = lval_alloc(LVAL_VEC);
+  v->vec = b;
+  return v;
+}
+
 lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+  lval* v = lval_alloc(LVAL_STR);
+  v->str = lstr_new(s, strlen(s));
   return v;
 }
 
 lval* lval_eval(lenv* e, lval* v) {
-  if(v->type == LVAL_SYM) {
+  if(ltype(v) == LVAL_SYM) {
+    //A resolved parameter is an indexed load when e is the frame it was
+    //resolved against. The slot is only a hint, so check the symbol.
+    int i = v->slot;
+    if(i >= 0 && i < e->count && e->syms[i] == v->sym) {
+      lval* x = lval_copy(e->vals[i]);
+      lval_del(v);
+      return x;
+    }
+
     lval* x = lenv_get(e, v);
     lval_del(v);
     return x;
   }
 
-  if(v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+  if(ltype(v) == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
   return v;
 }
 
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
   v->builtin = func;
   return v;
 }
 
 //Number type for lval
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  if(x >= LFIX_MIN && x <= LFIX_MAX) {
+    return (lval*)(((uintptr_t)x << 1) | 1);
+  }
+
+  lval* v = lval_alloc(LVAL_NUM);
   v->num = x;
   return v;
 }
 
+lval* lval_range(long start, long step, long length) {
+  lval* v = lval_alloc(LVAL_RANGE);
+  v->start = start;
+  v->step = step;
+  v->length = length;
+  return v;
+}
+
+//Item i of range v, which cannot overflow as the range was checked when
+//it was made
+long lrange_at(lval* v, long i) {
+  return (long)((unsigned long)v->start + (unsigned long)i * v->step);
+}
+
 //Error type for lval
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval* v = lval_alloc(LVAL_ERR);
 
-  va_list va;
+  va_list va, vb;
   va_start (va, fmt);
+  va_copy(vb, va);
 
-  v->err = malloc(512);
-
-  vsnprintf(v->err, 511, fmt, va);
-
-  v->err = realloc(v->err, strlen(v->err) + 1);
+  //Measure first so the buffer is allocated at its final size
+  int len = vsnprintf(NULL, 0, fmt, va);
+  v->err = malloc(sizeof(lstr) + len + 1);
+  v->err->refs = 1;
+  v->err->len = len;
+  vsnprintf(v->err->data, len + 1, fmt, vb);
 
+  va_end(vb);
   va_end(va);
 
   return v;
 }
 
+//Error sharing the text of string s
+lval* lval_err_str(lval* s) {
+  lval* v = lval_alloc(LVAL_ERR);
+  v->err = lstr_share(s, s->str);
+  return v;
+}
+
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  lval* v = lval_alloc(LVAL_SYM);
+  v->sym = lsym_intern(s);
+  v->slot = -1;
+  v->version = 0;
+  v->cache = NULL;
   return v;
 }
 
+lcells* lcells_new(int count) {
+  lcells* s = malloc(sizeof(lcells) + sizeof(lval*) * count);
+  s->refs = 1;
+  s->pool = lval_depth;
+  s->count = 0;
+  s->cap = count;
+  s->folded = NULL;
+  return s;
+}
+
+void lcells_del(lcells* s) {
+  if(s->pool <= lval_floor || --s->refs > 0) { return; }
+
+  for(int i = 0; i < s->count; i++) {
+    lval_del(s->items[i]);
+  }
+  if(s->folded) { lval_del(s->folded); }
+  free(s);
+}
+
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_alloc(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->store = NULL;
   return v;
 }
 
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_alloc(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->store = NULL;
   return v;
 }
 
+//Another reference to v. Values are immutable once shared, so this is
+//all a copy needs to be
 lval* lval_copy(lval* v) {
+  if(!LFIX(v) && v->pool > lval_floor) { v->refs++; }
+  return v;
+}
 
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+//Node of the same type as v holding the same payload, in the current pool
+lval* lval_dup(lval* v) {
+  lval* x = lval_alloc(v->type);
 
   switch(v->type) {
     
     case LVAL_FUN: 
-      if(v->builtin) {
-        x->builtin = v->builtin;
-      } else {
-        x->builtin = NULL;
+      x->builtin = v->builtin;
+      if(!v->builtin) {
         x->env = lenv_copy(v->env);
         x->formals = lval_copy(v->formals);
         x->body = lval_copy(v->body);
+        //Workers leave code and memo tables to the thread they belong to
+        int own = v->pool > lval_floor;
+        x->code = own && v->code ? lcode_copy(v->code) : NULL;
+        x->memo = own && v->memo ? lmemo_copy(v->memo) : NULL;
       }
     break;
     case LVAL_NUM: x->num = v->num; break;
 
-    case LVAL_ERR:
-      x->err = malloc(strlen(v->err) + 1);
-      strcpy(x->err, v->err); break;
+    case LVAL_ERR: x->err = lstr_share(v, v->err); break;
 
     case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym); break;
-    case LVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, x->str); break;
+      x->sym = v->sym;
+      x->slot = v->slot;
+      x->version = v->version;
+      x->cache = v->cache; break;
+    case LVAL_STR: x->str = lstr_share(v, v->str); break;
+    case LVAL_VEC: x->vec = lvec_share(v); break;
+    case LVAL_RANGE:
+      x->start = v->start;
+      x->step = v->step;
+      x->length = v->length;
+      break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
+      x->cell = v->cell;
+      x->store = v->store;
+      if(x->store && x->store->pool > lval_floor) { x->store->refs++; }
+      break;
+  }
+
+  return x;
+}
+
+//Give an unshared expression a store of its own that ends where its view
+//does, so its cells can be changed in place and appended to
+void lval_detach(lval* v) {
+  lcells* s = v->store;
+  if(s && s->refs == 1 && s->pool == lval_depth
+    && v->cell + v->count == s->items + s->count) {
+    //Its cells are about to change
+    if(s->folded) {
+      lval_del(s->folded);
+      s->folded = NULL;
+    }
+    return;
+  }
+
+  lcells* n = lcells_new(v->count);
+  for(int i = 0; i < v->count; i++) {
+    n->items[i] = lval_copy(v->cell[i]);
+  }
+  n->count = v->count;
+
+  if(s) { lcells_del(s); }
+  v->store = n;
+  v->cell = n->items;
+}
+
+//Take ownership of v and return a version of it that may be changed in
+//place: v itself when nothing else refers to it and it lives in the
+//current pool, otherwise a shallow copy
+lval* lval_unshare(lval* v) {
+  if(LFIX(v) || (v->refs == 1 && v->pool == lval_depth)) { return v; }
+
+  lval* x = lval_dup(v);
+  lval_del(v);
+  return x;
+}
+
+//A reference to v that can be kept by something living in the given pool.
+//A node may only point at nodes in its own pool or older ones, so any part
+//of v allocated in a younger arena is copied out.
+lval* lval_move(lval* v, int pool) {
+  if(LFIX(v) || v->pool <= pool) { return lval_copy(v); }
+
+  int depth = lval_depth;
+  lval_depth = pool;
+  lval* x = lval_dup(v);
+
+  switch(x->type) {
+    case LVAL_FUN:
+      if(!x->builtin) {
+        lenv* env = lenv_move(x->env, pool);
+        lenv_del(x->env);
+        x->env = env;
+
+        lval* formals = lval_move(x->formals, pool);
+        lval_del(x->formals);
+        x->formals = formals;
+
+        lval* body = lval_move(x->body, pool);
+        lval_del(x->body);
+
+        //Compiled code points into the body it was compiled from
+        if(body != x->body && x->code) {
+          lcode_del(x->code);
+          x->code = NULL;
+        }
+        x->body = body;
+      }
+    break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if(!x->store || x->store->pool <= pool) { break; }
+
+      lval_detach(x);
       for(int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+        lval* c = lval_move(x->cell[i], pool);
+        lval_del(x->cell[i]);
+        x->cell[i] = c;
       }
-      break;
+      lfold_move(v, x);
+    break;
   }
 
+  lval_depth = depth;
   return x;
 }
 
 void lval_del(lval* v) {
+  if(LFIX(v) || v->pool <= lval_floor || --v->refs > 0) { return; }
+
   switch(v->type) {
-    case LVAL_NUM: break;
     case LVAL_FUN: 
       if(!v->builtin) {
         lenv_del(v->env);
         lval_del(v->formals);
         lval_del(v->body);
+        if(v->memo) { lmemo_del(v->memo); }
       }
     break;
 
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
-
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-      for(int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
-      }
-
-      free(v->cell);
+      if(v->store) { lcells_del(v->store); }
     break;
   }
 
-  free(v);
+  lval_release(v);
+  lval_free(v);
 }
 
-
-lval* lval_add(lval* v, lval* x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
-  return v;
+//Free only the buffers a node owns, leaving its children alone
+void lval_release(lval* v) {
+  switch(v->type) {
+    case LVAL_FUN:
+      if(!v->builtin && v->code) { lcode_del(v->code); }
+    break;
+    case LVAL_ERR: lstr_del(v->err); break;
+    case LVAL_STR: lstr_del(v->str); break;
+    case LVAL_VEC: lvec_del(v->vec); break;
+  }
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ?
-    lval_num(x) : lval_err("invalid number");
+//Drop a reference held by node v, unless it points into v's own arena
+void lval_del_outer(lval* v, lval* c) {
+  if(!LFIX(c) && c->pool < v->pool) { lval_del(c); }
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
-  t->contents[strlen(t->contents)-1] = '\0';
+//Tear down a node whose arena is being released
+void lval_sever(lval* v) {
+  switch(v->type) {
+    case LVAL_FUN:
+      if(!v->builtin) {
+        if(v->env->pool < v->pool) { lenv_del(v->env); }
+        lval_del_outer(v, v->formals);
+        lval_del_outer(v, v->body);
+        //Memo tables only hold values in the heap
+        if(v->memo) { lmemo_del(v->memo); }
+      }
+    break;
 
-  char* unescaped = malloc(strlen(t->contents+1)+1);
-  strcpy(unescaped, t->contents+1);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR: {
+      lcells* s = v->store;
+      if(s && s->pool > lval_floor && --s->refs == 0) {
+        for(int i = 0; i < s->count; i++) {
+          lval_del_outer(v, s->items[i]);
+        }
+        if(s->folded) { lval_del_outer(v, s->folded); }
+        free(s);
+      }
+    }
+    break;
 
-  unescaped = mpcf_unescape(unescaped);
+    case LVAL_ENV: lenv_sever((lenv*)v); return;
+  }
 
-  lval* str = lval_str(unescaped);
-  free(unescaped);
-  return str;
+  lval_release(v);
 }
 
-lval* lval_read(mpc_ast_t* t) {
-  
-  if(strstr(t->tag, "number")) { return lval_read_num(t); }
-  if(strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-  if(strstr(t->tag, "string")) { return lval_read_str(t); }
 
-  lval* x = NULL;
-  //if root
+/** =================
+Beginning of Garbage Collector
+===================== */
+
+//Reference counting frees most values the moment they die. The collector
+//traces the heap from the global environment and pinned roots to reclaim
+//what counting misses: cycles, and references a builtin forgot to drop.
+//Arenas act as the nursery, so only values promoted into the heap are
+//ever traced. Collections run only between top-level expressions, when no
+//evaluation is holding values on the C stack.
+
+#define LGC_ROOTS 64
+
+long lgc_threshold = 4 << 20;
+long lgc_heap_size = 32 << 20;
+long lgc_collections = 0;
+long lgc_freed = 0;
+long lgc_live = 0;
+int lgc_requested = 0;
+
+lenv* lgc_env = NULL;
+lval* lgc_roots[LGC_ROOTS];
+int lgc_nroots = 0;
+
+lval** lgc_stack = NULL;
+int lgc_top = 0;
+int lgc_cap = 0;
+
+void lgc_push_root(lval* v) {
+  if(lgc_nroots < LGC_ROOTS) { lgc_roots[lgc_nroots] = v; }
+  lgc_nroots++;
+}
+
+void lgc_pop_root(void) {
+  lgc_nroots--;
+}
+
+void lgc_mark(lval* v) {
+  if(LFIX(v) || v->mark) { return; }
+  v->mark = 1;
+
+  if(lgc_top == lgc_cap) {
+    lgc_cap = lgc_cap ? lgc_cap * 2 : 1024;
+    lgc_stack = realloc(lgc_stack, sizeof(lval*) * lgc_cap);
+  }
+  lgc_stack[lgc_top++] = v;
+}
+
+void lgc_mark_children(lval* v) {
+  switch(v->type) {
+    case LVAL_FUN:
+      if(!v->builtin) {
+        lgc_mark((lval*)v->env);
+        lgc_mark(v->formals);
+        lgc_mark(v->body);
+        if(v->memo) { lmemo_mark(v->memo); }
+      }
+    break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if(v->store) {
+        for(int i = 0; i < v->store->count; i++) { lgc_mark(v->store->items[i]); }
+        if(v->store->folded) { lgc_mark(v->store->folded); }
+      }
+    break;
+
+    case LVAL_ENV: {
+      lenv* e = (lenv*)v;
+      for(int i = 0; i < e->count; i++) { lgc_mark(e->vals[i]); }
+    }
+    break;
+  }
+}
+
+//Drop a reference a dead node holds on a live one
+void lgc_unref(lval* c) {
+  if(!LFIX(c) && c->mark) { c->refs--; }
+}
+
+void lgc_unref_children(lval* v) {
+  switch(v->type) {
+    case LVAL_FUN:
+      if(!v->builtin) {
+        lgc_unref((lval*)v->env);
+        lgc_unref(v->formals);
+        lgc_unref(v->body);
+        if(v->memo) { lmemo_unref(v->memo); }
+        v->memo = NULL;
+      }
+    break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: {
+      lcells* s = v->store;
+      if(s && --s->refs == 0) {
+        for(int i = 0; i < s->count; i++) { lgc_unref(s->items[i]); }
+        if(s->folded) { lgc_unref(s->folded); }
+        free(s);
+      }
+      v->store = NULL;
+    }
+    break;
+
+    case LVAL_ENV: {
+      lenv* e = (lenv*)v;
+      for(int i = 0; i < e->count; i++) { lgc_unref(e->vals[i]); }
+    }
+    break;
+  }
+}
+
+void lgc_collect(void) {
+  //Mark
+  if(lgc_env) { lgc_mark((lval*)lgc_env); }
+  for(int i = 0; i < lgc_nroots && i < LGC_ROOTS; i++) {
+    lgc_mark(lgc_roots[i]);
+  }
+  while(lgc_top) { lgc_mark_children(lgc_stack[--lgc_top]); }
+
+  //Sweep in two passes, so every dead node has let go of the live ones
+  //before any of them is freed
+  lpool* p = &lval_pools[0];
+  for(int pass = 0; pass < 2; pass++) {
+    lgc_live = 0;
+
+    for(int k = 0; k < LPOOL_CLASSES; k++) {
+      size_t size = (k + 1) * LPOOL_GRAIN;
+
+      for(lchunk* c = p->slabs[k].chunks; c; c = c->next) {
+        for(char* n = (char*)c + sizeof(lchunk); n < c->top; n += size) {
+          lval* v = (lval*)n;
+          if(v->type == LVAL_FREE) { continue; }
+
+          if(v->mark) {
+            if(pass == 1) { v->mark = 0; }
+            lgc_live++;
+          } else if(pass == 0) {
+            lgc_unref_children(v);
+          } else {
+            if(v->type == LVAL_ENV) {
+              lenv_release((lenv*)v);
+            } else {
+              lval_release(v);
+            }
+            lval_free(v);
+            lgc_freed++;
+          }
+        }
+      }
+    }
+  }
+
+  lgc_collections++;
+  lgc_allocated = 0;
+  lgc_requested = 0;
+  if(lgc_heap_bytes > lgc_heap_size) { lgc_heap_size *= 2; }
+}
+
+//Called between top-level expressions
+void lgc_maybe(void) {
+  if(lval_nesting) { return; }
+  if(lgc_requested
+    || lgc_allocated >= lgc_threshold
+    || lgc_heap_bytes > lgc_heap_size) {
+    lgc_collect();
+  }
+}
+
+/** =================
+End of Garbage Collector
+===================== */
+
+
+//Make room for n more cells at the end of v. Stores grow geometrically,
+//so an n-element list is built with O(log n) reallocations.
+lval* lval_grow(lval* v, int n) {
+  v = lval_unshare(v);
+  lval_detach(v);
+
+  lcells* s = v->store;
+  if(s->count + n <= s->cap) { return v; }
+
+  //The store is ours alone, so cells popped off the front can go
+  int off = v->cell - s->items;
+  for(int i = 0; i < off; i++) {
+    lval_del(s->items[i]);
+  }
+  memmove(s->items, v->cell, sizeof(lval*) * v->count);
+  s->count = v->count;
+
+  if(s->count + n > s->cap) {
+    int cap = s->cap ? s->cap : 4;
+    while(cap < s->count + n) { cap *= 2; }
+    s = realloc(s, sizeof(lcells) + sizeof(lval*) * cap);
+    s->cap = cap;
+  }
+
+  v->store = s;
+  v->cell = s->items;
+  return v;
+}
+
+lval* lval_add(lval* v, lval* x) {
+  v = lval_grow(v, 1);
+  v->cell[v->count++] = x;
+  v->store->count++;
+  return v;
+}
+
+//Replace the n cells of v starting at i with references to m items
+lval* lval_splice(lval* v, int i, int n, lval** items, int m) {
+  v = lval_grow(v, m > n ? m - n : 0);
+
+  for(int k = 0; k < n; k++) {
+    lval_del(v->cell[i+k]);
+  }
+  memmove(&v->cell[i+m], &v->cell[i+n], sizeof(lval*) * (v->count-i-n));
+  for(int k = 0; k < m; k++) {
+    v->cell[i+k] = lval_copy(items[k]);
+  }
+
+  v->count += m - n;
+  v->store->count += m - n;
+  return v;
+}
+
+lval* lval_append(lval* v, lval** items, int n) {
+  if(n == 0) { return v; }
+  return lval_splice(v, v->count, 0, items, n);
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ?
+    lval_num(x) : lval_err("invalid number");
+}
+
+lval* lval_read_str(mpc_ast_t* t) {
+  t->contents[strlen(t->contents)-1] = '\0';
+
+  char* unescaped = malloc(strlen(t->contents+1)+1);
+  strcpy(unescaped, t->contents+1);
+
+  unescaped = mpcf_unescape(unescaped);
+
+  lval* str = lval_alloc(LVAL_STR);
+  str->str = lstr_new(unescaped, strlen(unescaped));
+  free(unescaped);
+  return str;
+}
+
+lval* lval_read(mpc_ast_t* t) {
+  
+  if(strstr(t->tag, "number")) { return lval_read_num(t); }
+  if(strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  if(strstr(t->tag, "string")) { return lval_read_str(t); }
+
+  lval* x = NULL;
+  //if root
   if(strcmp(t->tag, ">") == 0) {
     if(t->children_num == 2) {
       return lval_read(t->children[1]);
@@ -401,6 +1423,7 @@ lval* lval_read(mpc_ast_t* t) {
 
   if(strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
   if(strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+  x = lval_grow(x, t->children_num);
   
   for(int i = 0; i < t->children_num; i++) {
     if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
@@ -415,101 +1438,168 @@ lval* lval_read(mpc_ast_t* t) {
 }
 
 lval* lval_pop(lval* v, int i) {
-  lval* x = v->cell[i];
-
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
-  
-  v->count--;
+  //Popping the front just narrows the view, the store keeps its reference
+  if(i == 0) {
+    lval* x = lval_copy(v->cell[0]);
+    v->cell++;
+    v->count--;
+    return x;
+  }
 
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  lval* x = lval_copy(v->cell[i]);
+  lval_splice(v, i, 1, NULL, 0);
   return x;
 }
 
 lval* lval_take(lval* v, int i) {
-  lval* x = lval_pop(v, i);
+  lval* x = lval_copy(v->cell[i]);
   lval_del(v);
   return x;
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
 
   v->builtin = NULL;
   v->env = lenv_new();
 
   v->formals = formals;
   v->body = body;
+  v->code = NULL;
+  v->memo = NULL;
   return v;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-  if(f->builtin) { return f->builtin(e, a); }
+//Bind the arguments a to lambda f. Functions are never changed: a call
+//gets a frame with a slot for each of f's formals, holding the arguments
+//bound by earlier partial applications followed by these. Returns the
+//frame once every formal is bound, for f's body to run in. Otherwise *r
+//is set to an error, or to a partial application: a function like f
+//whose env is the frame.
+lenv* lval_frame(lenv* e, lval* f, lval* a, lval** r) {
+  lval* formals = f->formals;
+  lenv* p = f->env;
+  int pos = p->bound;
+
+  int slots = 0;
+  for(int i = 0; i < formals->count; i++) {
+    if(formals->cell[i]->sym != lsym_amp) { slots++; }
+  }
+
+  lenv* frame = lenv_new();
+  if(slots) { lenv_reserve(frame, slots); }
+  for(int i = 0; i < p->count; i++) {
+    lenv_push(frame, p->syms[i], lval_copy(p->vals[i]));
+  }
 
   int given = a->count;
-  int total = f->formals->count;
+  int total = formals->count - pos;
 
-  while(a->count) {
-    
-    if(f->formals->count == 0) {
+  for(int i = 0; i < a->count; i++) {
+
+    if(pos == formals->count) {
       lval_del(a);
-      return lval_err(
+      lenv_del(frame);
+      *r = lval_err(
         "Function passed too many arguments. "
         "Got %i, Expected %i.", given, total);
+      return NULL;
     }
 
-    lval* sym = lval_pop(f->formals, 0);
+    lval* sym = formals->cell[pos++];
+
+    if(sym->sym == lsym_amp) {
 
-    if(strcmp(sym->sym, "&") == 0) {
-      
-      if(f->formals->count != 1) {
+      if(formals->count - pos != 1) {
         lval_del(a);
-        return lval_err("Function format invalid. "
+        lenv_del(frame);
+        *r = lval_err("Function format invalid. "
           "Symbol '&' not followed by single symbol.");
+        return NULL;
       }
 
-      lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(nsym);
+      lval* rest = lval_append(lval_qexpr(), &a->cell[i], a->count - i);
+      lenv_put(frame, formals->cell[pos++], rest);
+      lval_del(rest);
       break;
     }
-    lval* val = lval_pop(a, 0);
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+    lenv_put(frame, sym, a->cell[i]);
   }
 
   lval_del(a);
 
-  if(f->formals->count > 0 &&
-    strcmp(f->formals->cell[0]->sym, "&") == 0) {
-    
-    if(f->formals->count != 2) {
-      return lval_err("Function format invalid. "
+  if(pos < formals->count &&
+    formals->cell[pos]->sym == lsym_amp) {
+
+    if(formals->count - pos != 2) {
+      lenv_del(frame);
+      *r = lval_err("Function format invalid. "
         "Symbol '&' not followed by single symbol.");
+      return NULL;
     }
 
-    lval_del(lval_pop(f->formals, 0));
-
-    lval* sym = lval_pop(f->formals, 0);
-    lval* val = lval_qexpr();
+    lval* rest = lval_qexpr();
+    lenv_put(frame, formals->cell[pos+1], rest);
+    lval_del(rest);
+    pos += 2;
+  }
 
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+  frame->bound = pos;
+  if(pos == formals->count) {
+    frame->par = e;
+    return frame;
   }
 
-  if (f->formals->count == 0) {
-    f->env->par = e;
+  lval* x = lval_alloc(LVAL_FUN);
+  x->builtin = NULL;
+  x->env = frame;
+  x->formals = lval_copy(formals);
+  x->body = lval_copy(f->body);
+  x->code = f->code && f->pool > lval_floor ? lcode_copy(f->code) : NULL;
+  x->memo = NULL;
+  *r = x;
+  return NULL;
+}
 
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    return lval_copy(f);
+//As lval_frame, except that a memoized function is never entered: its
+//result is looked up, or worked out there and then, and left in *r
+lenv* lval_bind(lenv* e, lval* f, lval* a, lval** r) {
+  if(f->memo && !lval_worker) {
+    *r = lmemo_call(e, f, a);
+    return NULL;
+  }
+  return lval_frame(e, f, a, r);
+}
+
+//Run the body of lambda f in frame, which is used up
+lval* lval_enter(lval* f, lenv* frame) {
+  if(lvm_enabled) {
+    //Builtins calling back into the vm recurse in C
+    if(lval_stack_low()) {
+      lenv_del(frame);
+      return lval_stack_err();
+    }
+    return lvm_run(frame, lvm_code(f), lval_copy(f));
   }
+
+  lval* r = builtin_eval(frame, lval_add(lval_sexpr(), lval_copy(f->body)));
+  lenv_del(frame);
+  return r;
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  if(f->builtin) { return lval_builtin(e, f->builtin, a); }
+
+  lval* r;
+  lenv* frame = lval_bind(e, f, a, &r);
+  if(!frame) { return r; }
+  return lval_enter(f, frame);
 }
 
 void lval_print(lval* v);
+void lval_formals_print(lval* f);
+void lval_range_print(lval* v);
+void lval_vec_print(lval* v);
 
 void lval_expr_print(lval* v, char open, char close) {
   putchar(open);
@@ -524,8 +1614,8 @@ void lval_expr_print(lval* v, char open, char close) {
 }
 
 void lval_print_str(lval* v) {
-  char* escaped = malloc(strlen(v->str)+1);
-  strcpy(escaped, v->str);
+  char* escaped = malloc(v->str->len + 1);
+  memcpy(escaped, v->str->data, v->str->len + 1);
   
   escaped = mpcf_escape(escaped);
 
@@ -534,400 +1624,2590 @@ void lval_print_str(lval* v) {
 }
 
 void lval_print(lval* v) {
-  switch(v->type) {
-    case LVAL_NUM:    printf("%li", v->num); break;
+  switch(ltype(v)) {
+    case LVAL_NUM:    printf("%li", lnum(v)); break;
     case LVAL_FUN:    
       if(v->builtin) {
         printf("<builtin>"); 
       } else {
-        printf("(\\ "); lval_print(v->formals);
+        printf("(\\ "); lval_formals_print(v);
         putchar(' '); lval_print(v->body); putchar(')');
       }
     break;
-    case LVAL_ERR:    printf("Error: %s", v->err); break;
-    case LVAL_SYM:    printf("%s", v->sym); break;
+    case LVAL_ERR:    printf("Error: %s", v->err->data); break;
+    case LVAL_SYM:    printf("%s", v->sym->name); break;
     case LVAL_STR:    lval_print_str(v); break;
     case LVAL_SEXPR:  lval_expr_print(v, '(', ')'); break;
     case LVAL_QEXPR:  lval_expr_print(v, '{', '}'); break;
+    case LVAL_RANGE:  lval_range_print(v); break;
+    case LVAL_VEC:    lval_vec_print(v); break;
     default:          printf("Unknown"); break;
   }
 }
 
 void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 
-lval* lval_join(lenv* e, lval* x, lval* y) {
-  
-  while(y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+//Ranges print as the list they stand for
+void lval_range_print(lval* v) {
+  putchar('{');
+  for(long i = 0; i < v->length; i++) {
+    printf("%li", lrange_at(v, i));
+    if(i != v->length - 1) { putchar(' '); }
+  }
+  putchar('}');
+}
+
+void lval_vec_print(lval* v) {
+  putchar('[');
+  for(int i = 0; i < v->vec->len; i++) {
+    printf("%li", v->vec->data[i]);
+    if(i != v->vec->len - 1) { putchar(' '); }
+  }
+  putchar(']');
+}
+
+//Formals of lambda f not yet bound by partial application
+void lval_formals_print(lval* f) {
+  putchar('{');
+  for(int i = f->env->bound; i < f->formals->count; i++) {
+    lval_print(f->formals->cell[i]);
+    if(i != (f->formals->count - 1)) { putchar(' '); }
   }
+  putchar('}');
+}
 
+lval* lval_join(lenv* e, lval* x, lval* y) {
+  x = lval_append(x, y->cell, y->count);
   lval_del(y);
   return x;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-  
-  for(int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+//Global value named by symbol s, from its cache when that is still
+//current. Only symbols never bound outside the global environment
+//qualify, since anything else could be shadowed by a frame.
+lval* lval_cached(lval* s) {
+  if(__atomic_load_n(&s->sym->local, __ATOMIC_RELAXED)) { return NULL; }
+
+  //Workers look the value up every time rather than write the cache
+  if(lval_worker) {
+    int i = lenv_find(lenv_global, s->sym);
+    return i < 0 ? NULL : lenv_global->vals[i];
   }
+  if(s->version == lenv_version) { return s->cache; }
+
+  int i = lenv_find(lenv_global, s->sym);
+  if(i < 0) { return NULL; }
+
+  s->version = lenv_version;
+  s->cache = lenv_global->vals[i];
+  return s->cache;
+}
+
+//Global function named by the head of v
+lval* lval_site(lval* v) {
+  if(v->count == 0 || ltype(v->cell[0]) != LVAL_SYM) { return NULL; }
+
+  lval* g = lval_cached(v->cell[0]);
+  return g && ltype(g) == LVAL_FUN ? g : NULL;
+}
 
-  //Erro checking
-  for(int i = 0; i< v->count; i++) {
-    if(v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+//Deepest evaluation allowed, or 0 for no limit. The tree walker counts
+//nested S-Expressions, which each take C stack; the vm counts frames on
+//its own stack, so it can go as deep as memory allows. Whatever the
+//limit, an evaluation that has used most of the C stack stops with an
+//error instead of overflowing it.
+int lval_max_depth = 0;
+__thread int lval_eval_depth = 0;
+
+//C stack each thread has, from RLIMIT_STACK, and where it was when the
+//thread began evaluating
+size_t lval_stack_size = 8 << 20;
+__thread uintptr_t lval_stack_base = 0;
+
+#ifndef _WIN32
+void lval_stack_init(void) {
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    lval_stack_size = rl.rlim_cur;
   }
+}
+
+void lval_stack_begin(void) {
+  lval_stack_base = (uintptr_t)__builtin_frame_address(0);
+}
+#else
+//Without getrlimit the stack is not measured, and only --max-depth
+//limits evaluation
+void lval_stack_init(void) {}
 
-  //empty
-  if(v->count == 0) { return v; }
-  //If single
-  if(v->count == 1 && v->cell[0]->type != LVAL_FUN) { return lval_take(v, 0); }
+void lval_stack_begin(void) {}
+#endif
 
-  //ensure first is a symbol
-  lval* f = lval_pop(v, 0);
+//Whether three quarters of the stack are used, which leaves the rest
+//for whatever builtins run before the next check
+int lval_stack_low(void) {
+  uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+  return lval_stack_base && lval_stack_base - sp > lval_stack_size / 4 * 3;
+}
 
-  if(f->type != LVAL_FUN) {
-    lval_println(f);
-    lval* err = lval_err(
-    "S-Expression starts with incorrect type."
-    "Got %s, Expected %s.",
-    ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f);
+lval* lval_depth_err(void) {
+  return lval_err("Maximum evaluation depth %i exceeded", lval_max_depth);
+}
+
+lval* lval_stack_err(void) {
+  return lval_err("Evaluation too deep, out of stack space");
+}
+
+//Evaluate S-Expression v in e. A call in tail position, meaning a branch
+//of if, the expression given to eval or the body of a lambda, carries on
+//in this loop instead of recursing, so tail calls take no C stack.
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+  if(lval_max_depth && lval_eval_depth >= lval_max_depth) {
     lval_del(v);
-    return err;
+    return lval_depth_err();
+  }
+  if(lval_stack_low()) {
+    lval_del(v);
+    return lval_stack_err();
+  }
+  lval_eval_depth++;
+
+  //Frames the loop has entered, innermost last
+  lenv** held = NULL;
+  int nheld = 0;
+  int sheld = 0;
+  lval* r;
+
+  while(1) {
+    lval* k = lval_folded(v);
+    if(k) {
+      r = lval_copy(k);
+      lval_del(v);
+      break;
+    }
+
+    v = lval_unshare(v);
+    lval_detach(v);
+
+    //The cached function is held for the call, as evaluating the
+    //arguments may bind its name to something else
+    lval* g = lval_site(v);
+    if(g) { g = lval_copy(g); }
+
+    for(int i = g ? 1 : 0; i < v->count; i++) {
+      v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+
+    //Erro checking
+    int err = -1;
+    for(int i = 0; i < v->count && err < 0; i++) {
+      if(ltype(v->cell[i]) == LVAL_ERR) { err = i; }
+    }
+    if(err >= 0) {
+      r = lval_take(v, err);
+      if(g) { lval_del(g); }
+      break;
+    }
+
+    lval* f = g;
+    if(g) {
+      lval_del(lval_pop(v, 0));
+    } else {
+      //empty
+      if(v->count == 0) {
+        r = v;
+        break;
+      }
+      //If single
+      if(v->count == 1 && ltype(v->cell[0]) != LVAL_FUN) {
+        r = lval_take(v, 0);
+        break;
+      }
+
+      //ensure first is a symbol
+      f = lval_pop(v, 0);
+
+      if(ltype(f) != LVAL_FUN) {
+        lval_println(f);
+        r = lval_err(
+        "S-Expression starts with incorrect type."
+        "Got %s, Expected %s.",
+        ltype_name(ltype(f)), ltype_name(LVAL_FUN));
+        lval_del(f);
+        lval_del(v);
+        break;
+      }
+    }
+
+    //v now holds the arguments
+    lbuiltin b = f->builtin;
+    if(b == builtin_if || b == builtin_eval) {
+      lval_del(f);
+      //if and eval skip lval_builtin, so ranges are forced here
+      if(lval_ranges(v)) { v = lval_force_args(v); }
+      if(ltype(v) != LVAL_ERR) {
+        v = b == builtin_if ? lval_if_branch(v) : lval_eval_expr(v);
+      }
+      if(ltype(v) != LVAL_SEXPR) {
+        r = v;
+        break;
+      }
+      continue;
+    }
+
+    if(b || lvm_enabled) {
+      r = lval_call(e, f, v);
+      lval_del(f);
+      break;
+    }
+
+    lenv* frame = lval_bind(e, f, v, &r);
+    if(!frame) {
+      lval_del(f);
+      break;
+    }
+
+    //Each held frame is the parent of the one after it, and the last is
+    //the parent of the callee's. Once the frames above one hide all of
+    //its bindings nothing can see it any more, so it is taken out of
+    //the chain and dropped. Every frame kept binds a name none above it
+    //do, which keeps the chain short however many calls the loop makes.
+    lenv* above = frame;
+    int kept = nheld;
+    for(int i = nheld - 1; i >= 0; i--) {
+      if(lenv_hidden(frame, held[i])) {
+        above->par = held[i]->par;
+        lenv_del(held[i]);
+        held[i] = NULL;
+        kept--;
+      } else {
+        above = held[i];
+      }
+    }
+    if(kept < nheld) {
+      int j = 0;
+      for(int i = 0; i < nheld; i++) {
+        if(held[i]) { held[j++] = held[i]; }
+      }
+      nheld = kept;
+    }
+
+    if(nheld == sheld) {
+      sheld = sheld ? sheld * 2 : 8;
+      held = realloc(held, sizeof(lenv*) * sheld);
+    }
+    held[nheld++] = frame;
+
+    e = frame;
+    v = lval_unshare(lval_copy(f->body));
+    v->type = LVAL_SEXPR;
+    lval_del(f);
+  }
+
+  while(nheld) { lenv_del(held[--nheld]); }
+  free(held);
+  lval_eval_depth--;
+  return r;
+}
+
+/** =================
+Beginning of Virtual Machine
+===================== */
+
+//Function bodies and top-level expressions can also be compiled to
+//bytecode for a stack machine, selected with --vm or (load "file" "vm").
+//Calls between lambdas push vm frames instead of recursing in C, and a
+//call in tail position reuses the caller's frame when the callee hides
+//all of its bindings. Builtins still run as they do for the tree walker.
+
+enum { LOP_CONST, LOP_LOCAL, LOP_GLOBAL, LOP_CALL, LOP_TAIL,
+  LOP_BRANCH, LOP_JUMP, LOP_RETURN, LOP_FOLDED };
+
+//Constants are borrowed from the expression the code was compiled from,
+//which is kept alive by whatever holds the code. Code compiled while if
+//named the builtin turns it into a branch, and is only valid as long as
+//it still does.
+struct lcode {
+  int refs;
+  unsigned version;
+  int fast_if;
+  int count;
+  int size;
+  int* ops;
+  int nconsts;
+  int sconsts;
+  lval** consts;
+};
+
+typedef struct lframe {
+  lcode* code;
+  int pc;
+  lval* f;
+  lenv* env;
+  lval* src;
+} lframe;
+
+__thread int lvm_enabled = 0;
+
+lval** lvm_stack = NULL;
+int lvm_sp = 0;
+int lvm_ssize = 0;
+
+lframe* lvm_frames = NULL;
+int lvm_fp = 0;
+int lvm_fsize = 0;
+
+lcode* lcode_new(void) {
+  lcode* c = malloc(sizeof(lcode));
+  c->refs = 1;
+  c->version = lenv_version;
+  c->fast_if = 0;
+  c->count = 0;
+  c->size = 0;
+  c->ops = NULL;
+  c->nconsts = 0;
+  c->sconsts = 0;
+  c->consts = NULL;
+  return c;
+}
+
+lcode* lcode_copy(lcode* c) {
+  c->refs++;
+  return c;
+}
+
+void lcode_del(lcode* c) {
+  if(--c->refs > 0) { return; }
+  free(c->ops);
+  free(c->consts);
+  free(c);
+}
+
+//Append an instruction word, returning its position
+int lcode_emit(lcode* c, int op) {
+  if(c->count == c->size) {
+    c->size = c->size ? c->size * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->size);
+  }
+  c->ops[c->count] = op;
+  return c->count++;
+}
+
+int lcode_const(lcode* c, lval* v) {
+  if(c->nconsts == c->sconsts) {
+    c->sconsts = c->sconsts ? c->sconsts * 2 : 8;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->sconsts);
+  }
+  c->consts[c->nconsts] = v;
+  return c->nconsts++;
+}
+
+int lvm_if_ok(void) {
+  if(lsym_if->local) { return 0; }
+  int i = lenv_find(lenv_global, lsym_if);
+  if(i < 0) { return 0; }
+
+  lval* f = lenv_global->vals[i];
+  return ltype(f) == LVAL_FUN && f->builtin == builtin_if;
+}
+
+void lvm_compile_expr(lcode* c, lval* v, lval* formals, int tail);
+void lvm_compile_sexpr_code(lcode* c, lval* v, lval* formals, int tail);
+
+//Compile the items of v evaluated as an S-Expression
+void lvm_compile_sexpr(lcode* c, lval* v, lval* formals, int tail) {
+  //A folded expression pushes its value and skips the code computing it,
+  //for as long as the fold holds
+  if(v->store && v->store->folded) {
+    lcode_emit(c, LOP_FOLDED);
+    lcode_emit(c, lcode_const(c, v));
+    int skip = lcode_emit(c, 0);
+    lvm_compile_sexpr_code(c, v, formals, tail);
+    c->ops[skip] = c->count;
+    if(tail) { lcode_emit(c, LOP_RETURN); }
+    return;
+  }
+  lvm_compile_sexpr_code(c, v, formals, tail);
+}
+
+void lvm_compile_sexpr_code(lcode* c, lval* v, lval* formals, int tail) {
+  //(if cond {then} {else}) with literal branches becomes a branch
+  if(c->fast_if && v->count == 4
+    && ltype(v->cell[0]) == LVAL_SYM && v->cell[0]->sym == lsym_if
+    && ltype(v->cell[2]) == LVAL_QEXPR && ltype(v->cell[3]) == LVAL_QEXPR) {
+
+    lvm_compile_expr(c, v->cell[1], formals, 0);
+    int branch = lcode_emit(c, LOP_BRANCH);
+    lcode_emit(c, 0);
+    lcode_emit(c, -1);
+
+    lvm_compile_sexpr(c, v->cell[2], formals, tail);
+    if(tail) {
+      c->ops[branch+1] = c->count;
+      lvm_compile_sexpr(c, v->cell[3], formals, tail);
+    } else {
+      int jump = lcode_emit(c, LOP_JUMP);
+      lcode_emit(c, 0);
+      c->ops[branch+1] = c->count;
+      lvm_compile_sexpr(c, v->cell[3], formals, tail);
+      c->ops[jump+1] = c->count;
+      c->ops[branch+2] = c->count;
+    }
+    return;
   }
 
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+  for(int i = 0; i < v->count; i++) {
+    lvm_compile_expr(c, v->cell[i], formals, 0);
+  }
+
+  //A tail call that cannot reuse the frame returns normally
+  lcode_emit(c, tail ? LOP_TAIL : LOP_CALL);
+  lcode_emit(c, v->count);
+  if(tail) { lcode_emit(c, LOP_RETURN); }
+}
+
+void lvm_compile_expr(lcode* c, lval* v, lval* formals, int tail) {
+  switch(ltype(v)) {
+    case LVAL_SEXPR:
+      lvm_compile_sexpr(c, v, formals, tail);
+    return;
+
+    case LVAL_SYM: {
+      int slot = formals ? lval_slot(formals, v->sym) : -1;
+      if(slot >= 0) {
+        lcode_emit(c, LOP_LOCAL);
+        lcode_emit(c, lcode_const(c, v));
+        lcode_emit(c, slot);
+      } else {
+        lcode_emit(c, LOP_GLOBAL);
+        lcode_emit(c, lcode_const(c, v));
+      }
+    }
+    break;
+
+    default:
+      lcode_emit(c, LOP_CONST);
+      lcode_emit(c, lcode_const(c, v));
+    break;
+  }
+
+  if(tail) { lcode_emit(c, LOP_RETURN); }
+}
+
+//Compile v, either as a whole expression or, for a body, its items
+lcode* lvm_compile(lval* v, lval* formals, int body) {
+  lcode* c = lcode_new();
+  c->fast_if = lvm_if_ok();
+
+  if(body) {
+    lvm_compile_sexpr(c, v, formals, 1);
+  } else {
+    lvm_compile_expr(c, v, NULL, 1);
+  }
+  return c;
+}
+
+//Current code for lambda f, compiling its body if it has none yet or the
+//globals it was compiled against have changed under it
+lcode* lvm_code(lval* f) {
+  lcode* c = f->code;
+  if(c && c->version != lenv_version) {
+    if(c->fast_if == lvm_if_ok()) {
+      c->version = lenv_version;
+    } else {
+      lcode_del(c);
+      c = NULL;
+    }
+  }
+
+  if(!c) { c = f->code = lvm_compile(f->body, f->formals, 1); }
+  return c;
+}
+
+void lvm_push(lval* v) {
+  if(lvm_sp == lvm_ssize) {
+    lvm_ssize = lvm_ssize ? lvm_ssize * 2 : 256;
+    lvm_stack = realloc(lvm_stack, sizeof(lval*) * lvm_ssize);
+  }
+  lvm_stack[lvm_sp++] = v;
+}
+
+//Frames own a reference to their code, to the function, if any, they
+//run along with env, its frame of bindings, and to the expression, if
+//any, the code was compiled from for this frame alone
+void lvm_enter(lcode* code, lval* f, lenv* env, lval* src) {
+  if(lvm_fp == lvm_fsize) {
+    lvm_fsize = lvm_fsize ? lvm_fsize * 2 : 64;
+    lvm_frames = realloc(lvm_frames, sizeof(lframe) * lvm_fsize);
+  }
+
+  code->refs++;
+  lframe* fr = &lvm_frames[lvm_fp++];
+  fr->code = code;
+  fr->pc = 0;
+  fr->f = f;
+  fr->env = env;
+  fr->src = src;
+}
+
+void lvm_leave(void) {
+  lframe* fr = &lvm_frames[--lvm_fp];
+  lcode_del(fr->code);
+  if(fr->f) {
+    lenv_del(fr->env);
+    lval_del(fr->f);
+  }
+  if(fr->src) { lval_del(fr->src); }
+}
+
+//Evaluate the n values on top of the stack as an S-Expression does. What
+//the vm should run next instead is returned in *next: a lambda, with
+//the frame to run it in in *frame, or the S-Expression chosen by if or
+//eval, which runs in e.
+lval* lvm_apply(lenv* e, int n, lval** next, lenv** frame) {
+  lvm_sp -= n;
+  lval** items = &lvm_stack[lvm_sp];
+  *next = NULL;
+
+  for(int i = 0; i < n; i++) {
+    if(ltype(items[i]) == LVAL_ERR) {
+      lval* x = items[i];
+      for(int k = 0; k < n; k++) {
+        if(k != i) { lval_del(items[k]); }
+      }
+      return x;
+    }
+  }
+
+  if(n == 0) { return lval_sexpr(); }
+
+  lval* f = items[0];
+  if(n == 1 && ltype(f) != LVAL_FUN) { return f; }
+
+  if(ltype(f) != LVAL_FUN) {
+    lval_println(f);
+    lval* err = lval_err(
+    "S-Expression starts with incorrect type."
+    "Got %s, Expected %s.",
+    ltype_name(ltype(f)), ltype_name(LVAL_FUN));
+    for(int i = 0; i < n; i++) { lval_del(items[i]); }
+    return err;
+  }
+
+  //The arguments move off the stack before anything can push over them
+  lval* a = lval_grow(lval_sexpr(), n - 1);
+  memcpy(a->cell, items + 1, sizeof(lval*) * (n - 1));
+  a->count = n - 1;
+  a->store->count = n - 1;
+
+  lbuiltin b = f->builtin;
+  if(b == builtin_if || b == builtin_eval) {
+    lval_del(f);
+    //As in the tree walker, ranges are forced here
+    if(lval_ranges(a)) { a = lval_force_args(a); }
+    if(ltype(a) == LVAL_ERR) { return a; }
+    lval* x = b == builtin_if ? lval_if_branch(a) : lval_eval_expr(a);
+    if(ltype(x) != LVAL_SEXPR) { return x; }
+    *next = x;
+    return NULL;
+  }
+
+  if(b) {
+    lval* r = lval_builtin(e, b, a);
+    lval_del(f);
+    return r;
+  }
+
+  lval* x;
+  *frame = lval_bind(e, f, a, &x);
+  if(*frame) {
+    *next = f;
+    return NULL;
+  }
+  lval_del(f);
+  return x;
+}
+
+//Run code in env e until it returns. If f is given, e is a frame for
+//it, and both are owned by the vm from here on.
+lval* lvm_run(lenv* e, lcode* code, lval* f) {
+  int floor = lvm_fp;
+  lvm_enter(code, f, e, NULL);
+
+  while(1) {
+    lframe* fr = &lvm_frames[lvm_fp - 1];
+    int* ops = fr->code->ops;
+    lval** consts = fr->code->consts;
+    lval* r = NULL;
+
+    switch(ops[fr->pc++]) {
+      case LOP_CONST:
+        lvm_push(lval_copy(consts[ops[fr->pc++]]));
+      continue;
+
+      case LOP_LOCAL: {
+        lval* s = consts[ops[fr->pc++]];
+        int i = ops[fr->pc++];
+        lenv* env = fr->env;
+        lvm_push(i < env->count && env->syms[i] == s->sym ?
+          lval_copy(env->vals[i]) : lenv_get(env, s));
+      }
+      continue;
+
+      case LOP_GLOBAL: {
+        lval* s = consts[ops[fr->pc++]];
+        lval* g = lval_cached(s);
+        lvm_push(g ? lval_copy(g) : lenv_get(fr->env, s));
+      }
+      continue;
+
+      case LOP_JUMP:
+        fr->pc = ops[fr->pc];
+      continue;
+
+      case LOP_FOLDED: {
+        lval* k = lval_folded(consts[ops[fr->pc]]);
+        if(k) {
+          lvm_push(lval_copy(k));
+          fr->pc = ops[fr->pc+1];
+        } else {
+          fr->pc += 2;
+        }
+      }
+      continue;
+
+      case LOP_BRANCH: {
+        lval* x = lvm_stack[--lvm_sp];
+        int els = ops[fr->pc];
+        int end = ops[fr->pc+1];
+        fr->pc += 2;
+
+        if(ltype(x) == LVAL_NUM) {
+          if(!lnum(x)) { fr->pc = els; }
+          lval_del(x);
+          continue;
+        }
+
+        //What builtin_if would have said
+        if(ltype(x) == LVAL_ERR) {
+          r = x;
+        } else {
+          r = lval_err("Function '%s' passed incorrect type for argument %i. "
+            "Got %s, Expected %s.",
+            "if", 0, ltype_name(ltype(x)), ltype_name(LVAL_NUM));
+          lval_del(x);
+        }
+
+        if(end < 0) { break; }
+        lvm_push(r);
+        fr->pc = end;
+      }
+      continue;
+
+      case LOP_CALL:
+      case LOP_TAIL: {
+        int tail = ops[fr->pc-1] == LOP_TAIL;
+        int n = ops[fr->pc++];
+
+        lval* next;
+        lenv* frame;
+        lval* x = lvm_apply(fr->env, n, &next, &frame);
+        if(!next) {
+          lvm_push(x);
+          continue;
+        }
+
+        //Builtins may have run the vm and moved the frames
+        fr = &lvm_frames[lvm_fp - 1];
+
+        //An expression from if or eval is compiled to run on its own. In
+        //tail position it replaces the code of the current frame.
+        int sexpr = ltype(next) == LVAL_SEXPR;
+        if(sexpr && tail) {
+          lcode_del(fr->code);
+          if(fr->src) { lval_del(fr->src); }
+          fr->code = lvm_compile(next, NULL, 0);
+          fr->src = next;
+          fr->pc = 0;
+          continue;
+        }
+
+        int reuse = !sexpr && tail && fr->f
+          && lenv_shadows(frame, fr->env);
+        if(!reuse && lval_max_depth && lvm_fp >= lval_max_depth) {
+          if(!sexpr) { lenv_del(frame); }
+          lval_del(next);
+          lvm_push(lval_depth_err());
+          continue;
+        }
+
+        if(sexpr) {
+          lcode* c = lvm_compile(next, NULL, 0);
+          lvm_enter(c, NULL, fr->env, next);
+          lcode_del(c);
+          continue;
+        }
+
+        lcode* c = lvm_code(next);
+        if(reuse) {
+          frame->par = fr->env->par;
+          lvm_leave();
+        }
+        lvm_enter(c, next, frame, NULL);
+      }
+      continue;
+
+      case LOP_RETURN:
+        r = lvm_stack[--lvm_sp];
+      break;
+    }
+
+    lvm_leave();
+    if(lvm_fp == floor) { return r; }
+    lvm_push(r);
+  }
+}
+
+lval* lvm_eval(lenv* e, lval* v) {
+  if(ltype(v) != LVAL_SEXPR) { return lval_eval(e, v); }
+
+  lcode* c = lvm_compile(v, NULL, 0);
+  lval* r = lvm_run(e, c, NULL);
+  lcode_del(c);
+  lval_del(v);
+  return r;
+}
+
+//Evaluate v with whichever evaluator is selected
+lval* lval_run(lenv* e, lval* v) {
+  return lvm_enabled ? lvm_eval(e, v) : lval_eval(e, v);
+}
+
+/** =================
+End of Virtual Machine
+===================== */
+
+/** =================
+Beginning of builtin
+===================== */
+
+
+lval* builtin_var(lenv* e, lval* a, char* func) {
+  //Ranges are passed through to here, so the list must be checked
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+  lval* syms = a->cell[0];
+  for(int i = 0; i < syms->count; i++){
+    LASSERT(a, ltype(syms->cell[i]) == LVAL_SYM,
+      "Cannot define non-symbol, Got %s, Expected %s.",
+      ltype_name(ltype(syms->cell[i])), ltype_name(LVAL_SYM));
+  }
+
+  LASSERT(a, syms->count == a->count - 1,
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.",
+    func, a->count - 1, syms->count);
+
+  LASSERT(a, !lval_worker || strcmp(func, "def") != 0,
+    "Function 'def' cannot be used inside pmap.");
+
+  for(int i = 0; i < syms->count; i++) {
+    if(strcmp(func, "def") == 0) {
+      lenv_def(e, syms->cell[i], a->cell[i+1]);
+    }
+
+    if(strcmp(func, "=") == 0) {
+      lenv_put(e, syms->cell[i], a->cell[i+1]);
+    }
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+  return builtin_var(e, a, "def");
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+  return builtin_var(e, a, "=");
+}
+
+//Slot a call frame binds formal s in, or -1
+int lval_slot(lval* formals, lsym* s) {
+  int slot = 0;
+  for(int i = 0; i < formals->count; i++) {
+    lsym* f = formals->cell[i]->sym;
+    if(f == lsym_amp) { continue; }
+    if(f == s) { return slot; }
+    slot++;
+  }
+  return -1;
+}
+
+//Resolve symbols in a function body that name one of its formals to the
+//slot the call frame binds that formal in. Scoping is dynamic, so only
+//the function's own frame has a layout known here; everything else is
+//still looked up by name. The body may be shared, say with a lambda of
+//other formals, and the last to resolve it wins. That is safe, as
+//lval_eval only takes a slot when the frame binds the symbol there.
+void lval_resolve(lval* v, lval* formals) {
+  switch(ltype(v)) {
+    case LVAL_SYM: {
+      int slot = lval_slot(formals, v->sym);
+      if(slot >= 0) { v->slot = slot; }
+    }
+    break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for(int i = 0; i < v->count; i++) { lval_resolve(v->cell[i], formals); }
+    break;
+  }
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+  //TODO: Assert num
+  //TODO: Assert types
+
+  for(int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (ltype(a->cell[0]->cell[i]) == LVAL_SYM),
+      "Cannot define non-symbol, Got %s, Expected %s.",
+      ltype_name(ltype(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+  }
+
+  lval* formals = lval_pop(a, 0);
+  lval* body = lval_pop(a, 0);
+  lval_del(a);
+  //Workers may share the body with other threads
+  if(!lval_worker) { lval_resolve(body, formals); }
+  return lval_lambda(formals, body);
+}
+
+lval* builtin_head(lenv* e, lval *a) {
+  LASSERT(a, a->count == 1,
+    "Function 'head' passed too many arguments. "
+    "Got %i, Expected %i.",
+    a->count, 1);
+
+  if(ltype(a->cell[0]) == LVAL_RANGE) {
+    lval* x = lval_add(lval_qexpr(), lval_num(a->cell[0]->start));
+    lval_del(a);
+    return x;
+  }
+
+  LASSERT(a, ltype(a->cell[0]) == LVAL_QEXPR,
+    "Function 'head' passed incorrect type");
+  LASSERT(a, a->cell[0]->count != 0,
+    "Function 'head' passed {}");
+
+  lval* v = lval_unshare(lval_take(a, 0));
+  v->count = 1;
+  return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1,
+    "Function 'tail' passed too many arguments");
+
+  //Tails of ranges stay lazy
+  if(ltype(a->cell[0]) == LVAL_RANGE) {
+    lval* r = a->cell[0];
+    lval* x = r->length == 1 ? lval_qexpr()
+      : lval_range(r->start + r->step, r->step, r->length - 1);
+    lval_del(a);
+    return x;
+  }
+
+  LASSERT(a, ltype(a->cell[0]) == LVAL_QEXPR,
+    "Function 'tail' passed incorrect type");
+  LASSERT(a, a->cell[0]->count != 0,
+    "Function 'tail' passed {}!");
+
+  lval* v = lval_unshare(lval_take(a, 0));
+  lval_del(lval_pop(v, 0));
+  return v;
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+//Expression (eval {x}) evaluates, as an S-Expression, or an error
+lval* lval_eval_expr(lval* a) {
+  LASSERT(a, a->count == 1,
+    "Function 'eval' passed too many arguments");
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+  lval* x = lval_unshare(lval_take(a, 0));
+  x->type = LVAL_SEXPR;
+  return x;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+  return lval_eval(e, lval_eval_expr(a));
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+  for(int i = 0; i < a->count; i++) {
+    LASSERT(a, ltype(a->cell[i]) == LVAL_QEXPR,
+      "Function 'join' passed incorrect type");
+  }
+  
+  lval* x = lval_pop(a, 0);
+
+  int extra = 0;
+  for(int i = 0; i < a->count; i++) {
+    extra += a->cell[i]->count;
+  }
+  if(extra) { x = lval_grow(x, extra); }
+  
+  while(a->count) {
+    x = lval_join(e, x, lval_pop(a, 0));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+//Native versions of the list functions the standard library used to
+//define in Risky, which walked the list with tail on every step
+
+//Lists here are Q-Expressions or ranges
+long lval_list_len(lval* l) {
+  return ltype(l) == LVAL_RANGE ? l->length : l->count;
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_LIST("len", a, 0);
+
+  long n = lval_list_len(a->cell[0]);
+  lval_del(a);
+  return lval_num(n);
+}
+
+//Item x of a list evaluated as (eval (head l)) would be, so items that
+//are symbols or expressions read as they always have
+lval* lval_item(lenv* e, lval* x) {
+  switch(ltype(x)) {
+    case LVAL_SYM:
+    case LVAL_SEXPR:
+    case LVAL_FUN:
+      return lval_eval(e, lval_add(lval_sexpr(), lval_copy(x)));
+    default:
+      return lval_copy(x);
+  }
+}
+
+lval* lval_list_item(lenv* e, lval* l, long i) {
+  if(ltype(l) == LVAL_RANGE) { return lval_num(lrange_at(l, i)); }
+  return lval_item(e, l->cell[i]);
+}
+
+//Item n of the list in argument l
+lval* lval_nth(lenv* e, lval* a, char* func, int l, long n) {
+  lval* x = a->cell[l];
+  LASSERT(a, n >= 0 && n < lval_list_len(x),
+    "Function '%s' passed index %li for a list of %li items.",
+    func, n, lval_list_len(x));
+
+  x = lval_list_item(e, x, n);
+  lval_del(a);
+  return x;
+}
+
+lval* lval_nth_of(lenv* e, lval* a, char* func, long n) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_LIST(func, a, 0);
+  return lval_nth(e, a, func, 0, n);
+}
+
+lval* builtin_fst(lenv* e, lval* a) { return lval_nth_of(e, a, "fst", 0); }
+lval* builtin_snd(lenv* e, lval* a) { return lval_nth_of(e, a, "snd", 1); }
+lval* builtin_trd(lenv* e, lval* a) { return lval_nth_of(e, a, "trd", 2); }
+
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_LIST("nth", a, 1);
+  return lval_nth(e, a, "nth", 1, lnum(a->cell[0]));
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+  LASSERT_NUM("last", a, 1);
+  LASSERT_LIST("last", a, 0);
+  return lval_nth(e, a, "last", 0, lval_list_len(a->cell[0]) - 1);
+}
+
+//Higher order functions walk the list once, calling f through lval_call,
+//and stop at the first error
+
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_LIST("map", a, 1);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  long n = lval_list_len(l);
+  LASSERT(a, n <= INT_MAX,
+    "Function 'map' passed a list of %li items, too long for a result.", n);
+
+  lval* r = lval_qexpr();
+  if(n) { r = lval_grow(r, n); }
+
+  for(long i = 0; i < n; i++) {
+    lval* x = lval_list_item(e, l, i);
+    if(ltype(x) != LVAL_ERR) {
+      x = lval_call(e, f, lval_add(lval_sexpr(), x));
+    }
+    if(ltype(x) == LVAL_ERR) {
+      lval_del(r);
+      lval_del(a);
+      return x;
+    }
+    r = lval_add(r, x);
+  }
+
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_LIST("filter", a, 1);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  long n = lval_list_len(l);
+  lval* r = lval_qexpr();
+
+  for(long i = 0; i < n; i++) {
+    lval* x = lval_list_item(e, l, i);
+    lval* keep = x;
+    if(ltype(x) != LVAL_ERR) {
+      keep = lval_call(e, f, lval_add(lval_sexpr(), lval_copy(x)));
+    }
+    if(ltype(keep) != LVAL_NUM) {
+      if(ltype(keep) != LVAL_ERR) {
+        lval_del(keep);
+        keep = lval_err("Function 'filter' passed a predicate that returned "
+          "%s, Expected %s.", ltype_name(ltype(keep)), ltype_name(LVAL_NUM));
+      }
+      if(keep != x) { lval_del(x); }
+      lval_del(r);
+      lval_del(a);
+      return keep;
+    }
+
+    if(lnum(keep)) {
+      r = lval_add(r, x);
+    } else {
+      lval_del(x);
+    }
+    lval_del(keep);
+  }
+
+  lval_del(a);
+  return r;
+}
+
+//(foldl f z l) is (f (f (f z l0) l1) l2) and (foldr f z l) is
+//(f l0 (f l1 (f l2 z)))
+lval* lval_reduce(lenv* e, lval* a, char* func, int right) {
+  LASSERT_NUM(func, a, 3);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_LIST(func, a, 2);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+  lval* acc = lval_copy(a->cell[1]);
+  long n = lval_list_len(l);
+
+  //Items are read front to back either way, so foldr reads them first.
+  //Reading a range has no effects, so it can be read in any order.
+  lval* xs = NULL;
+  if(right && ltype(l) == LVAL_QEXPR) {
+    xs = lval_qexpr();
+    if(n) { xs = lval_grow(xs, n); }
+    for(int i = 0; i < l->count; i++) {
+      lval* x = lval_item(e, l->cell[i]);
+      if(ltype(x) == LVAL_ERR) {
+        lval_del(acc);
+        acc = x;
+        n = 0;
+        break;
+      }
+      xs = lval_add(xs, x);
+    }
+  }
+
+  for(long i = 0; i < n; i++) {
+    lval* x;
+    if(xs) {
+      x = lval_copy(xs->cell[n - 1 - i]);
+    } else {
+      x = lval_list_item(e, l, right ? n - 1 - i : i);
+      if(ltype(x) == LVAL_ERR) {
+        lval_del(acc);
+        acc = x;
+        break;
+      }
+    }
+
+    lval* args = lval_grow(lval_sexpr(), 2);
+    if(right) {
+      args = lval_add(lval_add(args, x), acc);
+    } else {
+      args = lval_add(lval_add(args, acc), x);
+    }
+    acc = lval_call(e, f, args);
+    if(ltype(acc) == LVAL_ERR) { break; }
+  }
+
+  if(xs) { lval_del(xs); }
+  lval_del(a);
+  return acc;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+  return lval_reduce(e, a, "foldl", 0);
+}
+
+lval* builtin_foldr(lenv* e, lval* a) {
+  return lval_reduce(e, a, "foldr", 1);
+}
+
+//(range start end) or (range start end step) is the numbers from start
+//to end inclusive, step apart. It is made lazily, as a range value.
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT_NUM_BETWEEN("range", a, 2, 3);
+  for(int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("range", a, i, LVAL_NUM);
+  }
+
+  long start = lnum(a->cell[0]);
+  long end = lnum(a->cell[1]);
+  long step = a->count == 3 ? lnum(a->cell[2]) : 1;
+  LASSERT(a, step != 0, "Function 'range' passed a step of 0.");
+  lval_del(a);
+
+  if(step > 0 ? start > end : start < end) { return lval_qexpr(); }
+
+  //Distances are taken unsigned, as they may not fit in a long
+  unsigned long span = step > 0
+    ? (unsigned long)end - (unsigned long)start
+    : (unsigned long)start - (unsigned long)end;
+  unsigned long stride = step > 0 ? (unsigned long)step : -(unsigned long)step;
+  unsigned long length = span / stride;
+  if(length >= LONG_MAX) {
+    return lval_err("Function 'range' passed a range too long to count.");
+  }
+
+  return lval_range(start, step, length + 1);
+}
+
+//The list a range stands for, in cells. Anything else is returned as is.
+lval* lval_force(lval* v) {
+  if(ltype(v) != LVAL_RANGE) { return v; }
+
+  if(v->length > INT_MAX) {
+    lval* err = lval_err("Range of %li items is too long to make a list.",
+      v->length);
+    lval_del(v);
+    return err;
+  }
+
+  lval* x = lval_grow(lval_qexpr(), v->length);
+  for(long i = 0; i < v->length; i++) {
+    x->cell[i] = lval_num(lrange_at(v, i));
+  }
+  x->count = v->length;
+  x->store->count = v->length;
+  lval_del(v);
+  return x;
+}
+
+//Arithmetic on machine words. Each step returns one of these, and the
+//plain operators wrap around where the checked ones report overflow.
+enum { LARITH_OK, LARITH_OVERFLOW, LARITH_DIV_ZERO, LARITH_MOD_ZERO };
+
+typedef int(*larith)(long x, long y, long* r);
+
+int larith_add(long x, long y, long* r) {
+  return __builtin_add_overflow(x, y, r) ? LARITH_OVERFLOW : LARITH_OK;
+}
+
+int larith_sub(long x, long y, long* r) {
+  return __builtin_sub_overflow(x, y, r) ? LARITH_OVERFLOW : LARITH_OK;
+}
+
+int larith_mul(long x, long y, long* r) {
+  return __builtin_mul_overflow(x, y, r) ? LARITH_OVERFLOW : LARITH_OK;
+}
+
+int larith_div(long x, long y, long* r) {
+  if(y == 0) { return LARITH_DIV_ZERO; }
+  if(y == -1) { return larith_sub(0, x, r); }
+  *r = x / y;
+  return LARITH_OK;
+}
+
+int larith_mod(long x, long y, long* r) {
+  if(y == 0) { return LARITH_MOD_ZERO; }
+  *r = y == -1 ? 0 : x % y;
+  return LARITH_OK;
+}
+
+//Exponentiation by squaring. A negative power truncates like division.
+int larith_pow(long x, long y, long* r) {
+  if(y < 0) {
+    if(x == 0) { return LARITH_DIV_ZERO; }
+    *r = x == 1 ? 1 : x == -1 ? (y & 1 ? -1 : 1) : 0;
+    return LARITH_OK;
+  }
+
+  long acc = 1;
+  int over = 0;
+  while(y) {
+    if(y & 1) { over |= __builtin_mul_overflow(acc, x, &acc); }
+    y >>= 1;
+    if(y) { over |= __builtin_mul_overflow(x, x, &x); }
+  }
+  *r = acc;
+  return over ? LARITH_OVERFLOW : LARITH_OK;
+}
+
+int larith_min(long x, long y, long* r) {
+  *r = x > y ? y : x;
+  return LARITH_OK;
+}
+
+int larith_max(long x, long y, long* r) {
+  *r = x < y ? y : x;
+  return LARITH_OK;
+}
+
+//Fold op over the arguments from the left in a single pass
+lval* lval_arith(lval* a, char* func, larith op, int checked) {
+  LASSERT(a, a->count > 0,
+    "Function '%s' passed no arguments", func);
+  for(int i = 0; i < a->count; i++) {
+    LASSERT(a, ltype(a->cell[i]) == LVAL_NUM,
+      "Cannot operate on non-number");
+  }
+
+  //Work on unboxed values so only the result is ever allocated
+  long r = lnum(a->cell[0]);
+  for(int i = 1; i < a->count; i++) {
+    int s = op(r, lnum(a->cell[i]), &r);
+    if(s == LARITH_OK || (s == LARITH_OVERFLOW && !checked)) { continue; }
+
+    lval_del(a);
+    switch(s) {
+      case LARITH_DIV_ZERO: return lval_err("Division By Zero");
+      case LARITH_MOD_ZERO: return lval_err("Modulo By Zero");
+      default: return lval_err("Integer overflow in '%s'", func);
+    }
+  }
+
+  lval_del(a);
+  return lval_num(r);
+}
+
+//(- x) negates
+lval* lval_minus(lval* a, char* func, int checked) {
+  if(a->count == 1 && ltype(a->cell[0]) == LVAL_NUM) {
+    long r;
+    int s = larith_sub(0, lnum(a->cell[0]), &r);
+    lval_del(a);
+    if(s && checked) { return lval_err("Integer overflow in '%s'", func); }
+    return lval_num(r);
+  }
+  return lval_arith(a, func, larith_sub, checked);
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+  return lval_arith(a, "+", larith_add, 0);
+}
+
+lval* builtin_minus(lenv* e, lval* a) {
+  return lval_minus(a, "-", 0);
+}
+
+lval* builtin_multi(lenv* e, lval* a) {
+  return lval_arith(a, "*", larith_mul, 0);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  return lval_arith(a, "/", larith_div, 0);
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+  return lval_arith(a, "%", larith_mod, 0);
+}
+
+lval* builtin_pow(lenv* e, lval* a) {
+  return lval_arith(a, "^", larith_pow, 0);
+}
+
+lval* builtin_min(lenv* e, lval* a) {
+  return lval_arith(a, "min", larith_min, 0);
+}
+
+lval* builtin_max(lenv* e, lval* a) {
+  return lval_arith(a, "max", larith_max, 0);
+}
+
+lval* builtin_checked_add(lenv* e, lval* a) {
+  return lval_arith(a, "checked+", larith_add, 1);
+}
+
+lval* builtin_checked_minus(lenv* e, lval* a) {
+  return lval_minus(a, "checked-", 1);
+}
+
+lval* builtin_checked_multi(lenv* e, lval* a) {
+  return lval_arith(a, "checked*", larith_mul, 1);
+}
+
+lval* builtin_checked_div(lenv* e, lval* a) {
+  return lval_arith(a, "checked/", larith_div, 1);
+}
+
+lval* builtin_checked_pow(lenv* e, lval* a) {
+  return lval_arith(a, "checked^", larith_pow, 1);
+}
+
+lval* builtin_exit(lenv* e, lval* a){
+  REPL = 0;
+  return a;
+}
+
+/** =================
+Beginning of builtin Conditionals
+===================== */
+
+lval* builtin_ord(lenv* e, lval* a, char* op) {
+  LASSERT_NUM(op, a, 2);
+  LASSERT_TYPE(op, a, 0, LVAL_NUM);
+  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+
+  int r;
+
+  if (strcmp(op, ">") == 0) {
+    r = (lnum(a->cell[0]) > lnum(a->cell[1]));
+  } else if(strcmp(op, "<") == 0) {
+    r = (lnum(a->cell[0]) < lnum(a->cell[1]));
+  } else if(strcmp(op, ">=") == 0) {
+    r = (lnum(a->cell[0]) >= lnum(a->cell[1]));
+  } else if(strcmp(op, "<=") == 0) {
+    r = (lnum(a->cell[0]) <= lnum(a->cell[1]));
+  } else {
+    lval_del(a);
+    return lval_err("Unknown comparison '%s'", op);
+  }
+
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<");
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">");
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<=");
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">=");
+}
+
+
+//A range equals any list of the same numbers
+int lval_eq_range(lval* r, lval* l) {
+  if(ltype(l) == LVAL_RANGE) {
+    return r->length == l->length && r->start == l->start
+      && (r->length == 1 || r->step == l->step);
+  }
+  if(ltype(l) != LVAL_QEXPR || l->count != r->length) { return 0; }
+  for(int i = 0; i < l->count; i++) {
+    lval* x = l->cell[i];
+    if(ltype(x) != LVAL_NUM || lnum(x) != lrange_at(r, i)) { return 0; }
+  }
+  return 1;
+}
+
+int lval_eq(lval* x, lval* y) {
+  if(ltype(x) == LVAL_RANGE) { return lval_eq_range(x, y); }
+  if(ltype(y) == LVAL_RANGE) { return lval_eq_range(y, x); }
+
+  //Confirm all are numbers
+  if(ltype(x) != ltype(y)) { return 0; }
+
+  switch (ltype(x)) {
+    case LVAL_NUM: return (lnum(x) == lnum(y));
+
+    case LVAL_ERR: return (x->err->len == y->err->len
+      && memcmp(x->err->data, y->err->data, x->err->len) == 0);
+    case LVAL_SYM: return (x->sym == y->sym);
+    case LVAL_STR: return (x->str->len == y->str->len
+      && memcmp(x->str->data, y->str->data, x->str->len) == 0);
+    case LVAL_VEC: return (x->vec->len == y->vec->len
+      && memcmp(x->vec->data, y->vec->data, sizeof(long) * x->vec->len) == 0);
+
+
+    case LVAL_FUN:
+      if(x->builtin || y->builtin) {
+        return x->builtin == y->builtin;
+      } else {
+        //Only the formals still to be bound count
+        int i = x->env->bound;
+        int j = y->env->bound;
+        if(x->formals->count - i != y->formals->count - j) { return 0; }
+        for(; i < x->formals->count; i++, j++) {
+          if(!lval_eq(x->formals->cell[i], y->formals->cell[j])) { return 0; }
+        }
+        return lval_eq(x->body, y->body);
+      }
+
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if(x->count != y->count) { return 0; }
+      for(int i = 0; i < x->count; i++) {
+        if(!lval_eq(x->cell[i], y->cell[i])) {return 0;}
+      }
+      return 1;
+    break;
+  }
+  
+  return 0;
+}
+
+lval* builtin_cmp(lenv* e, lval* a, char* op) {
+  LASSERT_NUM(op, a, 2);
+
+  int r;
+  if(strcmp(op, "==") == 0) {
+    r = lval_eq(a->cell[0], a->cell[1]);
+  } else if(strcmp(op, "!=") == 0){
+    r = !lval_eq(a->cell[0], a->cell[1]);
+  } else {
+    lval_del(a);
+    return lval_err("Unknown comparison '%s'", op);
+  }
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+  return builtin_cmp(e, a, "==");
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+  return builtin_cmp(e, a, "!=");
+}
+
+//Branch of (if c {then} {else}) to evaluate, as an S-Expression, or an
+//error
+lval* lval_if_branch(lval* a) {
+  LASSERT_NUM("if", a, 3);
+  LASSERT_TYPE("if", a, 0, LVAL_NUM);
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+  lval* x;
+
+  if(lnum(a->cell[0])) {
+    x = lval_take(a, 1);
+  } else {
+    x = lval_take(a, 2);
+  }
+
+  //Branches may still be shared with the body they were written in
+  x = lval_unshare(x);
+  x->type = LVAL_SEXPR;
+  return x;
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+  return lval_eval(e, lval_if_branch(a));
+}
+
+/** =================
+End of builtin Conditionals
+===================== */
+
+/** =================
+Beginning of Vectors
+===================== */
+
+//A vector holds numbers packed in one buffer, where a list points at a
+//node for each. Arithmetic on vectors runs in kernels picked once, when
+//the interpreter starts, for the best instructions the CPU supports.
+//Like + and *, vec+ and vec* wrap around on overflow.
+
+typedef struct lvec_kernels {
+  char* name;
+  void (*add)(long* r, long* x, long* y, int n);
+  void (*mul)(long* r, long* x, long* y, int n);
+  long (*sum)(long* x, int n);
+  long (*dot)(long* x, long* y, int n);
+  long (*min)(long* x, int n);
+  long (*max)(long* x, int n);
+} lvec_kernels;
+
+//Scalar kernels work in unsigned arithmetic, where wrapping is defined
+
+void lvec_add_scalar(long* r, long* x, long* y, int n) {
+  for(int i = 0; i < n; i++) {
+    r[i] = (long)((unsigned long)x[i] + (unsigned long)y[i]);
+  }
+}
+
+void lvec_mul_scalar(long* r, long* x, long* y, int n) {
+  for(int i = 0; i < n; i++) {
+    r[i] = (long)((unsigned long)x[i] * (unsigned long)y[i]);
+  }
+}
+
+long lvec_sum_scalar(long* x, int n) {
+  unsigned long s = 0;
+  for(int i = 0; i < n; i++) { s += (unsigned long)x[i]; }
+  return (long)s;
+}
+
+long lvec_dot_scalar(long* x, long* y, int n) {
+  unsigned long s = 0;
+  for(int i = 0; i < n; i++) { s += (unsigned long)x[i] * (unsigned long)y[i]; }
+  return (long)s;
+}
+
+long lvec_min_scalar(long* x, int n) {
+  long m = x[0];
+  for(int i = 1; i < n; i++) { if(x[i] < m) { m = x[i]; } }
+  return m;
+}
+
+long lvec_max_scalar(long* x, int n) {
+  long m = x[0];
+  for(int i = 1; i < n; i++) { if(x[i] > m) { m = x[i]; } }
+  return m;
+}
+
+lvec_kernels lvec_scalar = {
+  "scalar",
+  lvec_add_scalar, lvec_mul_scalar, lvec_sum_scalar,
+  lvec_dot_scalar, lvec_min_scalar, lvec_max_scalar
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+//Neither instruction set multiplies 64 bit lanes, so products are put
+//together from 32 bit halves: lo*lo + ((hi*lo + lo*hi) << 32)
+
+__attribute__((target("sse2")))
+static inline __m128i lvec_mul_sse2_lanes(__m128i a, __m128i b) {
+  __m128i cross = _mm_add_epi64(
+    _mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+    _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+  return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+}
+
+__attribute__((target("sse2")))
+void lvec_add_sse2(long* r, long* x, long* y, int n) {
+  int i = 0;
+  for(; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*)(x + i));
+    __m128i b = _mm_loadu_si128((__m128i*)(y + i));
+    _mm_storeu_si128((__m128i*)(r + i), _mm_add_epi64(a, b));
+  }
+  lvec_add_scalar(r + i, x + i, y + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void lvec_mul_sse2(long* r, long* x, long* y, int n) {
+  int i = 0;
+  for(; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*)(x + i));
+    __m128i b = _mm_loadu_si128((__m128i*)(y + i));
+    _mm_storeu_si128((__m128i*)(r + i), lvec_mul_sse2_lanes(a, b));
+  }
+  lvec_mul_scalar(r + i, x + i, y + i, n - i);
+}
+
+__attribute__((target("sse2")))
+long lvec_sum_sse2(long* x, int n) {
+  __m128i s = _mm_setzero_si128();
+  int i = 0;
+  for(; i + 2 <= n; i += 2) {
+    s = _mm_add_epi64(s, _mm_loadu_si128((__m128i*)(x + i)));
+  }
+  long lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, s);
+  return (long)((unsigned long)lanes[0] + (unsigned long)lanes[1]
+    + (unsigned long)lvec_sum_scalar(x + i, n - i));
+}
+
+__attribute__((target("sse2")))
+long lvec_dot_sse2(long* x, long* y, int n) {
+  __m128i s = _mm_setzero_si128();
+  int i = 0;
+  for(; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*)(x + i));
+    __m128i b = _mm_loadu_si128((__m128i*)(y + i));
+    s = _mm_add_epi64(s, lvec_mul_sse2_lanes(a, b));
+  }
+  long lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, s);
+  return (long)((unsigned long)lanes[0] + (unsigned long)lanes[1]
+    + (unsigned long)lvec_dot_scalar(x + i, y + i, n - i));
+}
+
+//SSE2 cannot compare 64 bit lanes, so min and max stay scalar
+lvec_kernels lvec_sse2 = {
+  "sse2",
+  lvec_add_sse2, lvec_mul_sse2, lvec_sum_sse2,
+  lvec_dot_sse2, lvec_min_scalar, lvec_max_scalar
+};
+
+__attribute__((target("avx2")))
+static inline __m256i lvec_mul_avx2_lanes(__m256i a, __m256i b) {
+  __m256i cross = _mm256_add_epi64(
+    _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+    _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+long lvec_lanes_avx2(__m256i s) {
+  long lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, s);
+  return (long)((unsigned long)lanes[0] + (unsigned long)lanes[1]
+    + (unsigned long)lanes[2] + (unsigned long)lanes[3]);
+}
+
+__attribute__((target("avx2")))
+void lvec_add_avx2(long* r, long* x, long* y, int n) {
+  int i = 0;
+  for(; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x + i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(y + i));
+    _mm256_storeu_si256((__m256i*)(r + i), _mm256_add_epi64(a, b));
+  }
+  lvec_add_scalar(r + i, x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void lvec_mul_avx2(long* r, long* x, long* y, int n) {
+  int i = 0;
+  for(; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x + i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(y + i));
+    _mm256_storeu_si256((__m256i*)(r + i), lvec_mul_avx2_lanes(a, b));
+  }
+  lvec_mul_scalar(r + i, x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2")))
+long lvec_sum_avx2(long* x, int n) {
+  __m256i s = _mm256_setzero_si256();
+  int i = 0;
+  for(; i + 4 <= n; i += 4) {
+    s = _mm256_add_epi64(s, _mm256_loadu_si256((__m256i*)(x + i)));
+  }
+  return (long)((unsigned long)lvec_lanes_avx2(s)
+    + (unsigned long)lvec_sum_scalar(x + i, n - i));
+}
+
+__attribute__((target("avx2")))
+long lvec_dot_avx2(long* x, long* y, int n) {
+  __m256i s = _mm256_setzero_si256();
+  int i = 0;
+  for(; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x + i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(y + i));
+    s = _mm256_add_epi64(s, lvec_mul_avx2_lanes(a, b));
+  }
+  return (long)((unsigned long)lvec_lanes_avx2(s)
+    + (unsigned long)lvec_dot_scalar(x + i, y + i, n - i));
+}
+
+//Lanes of m are kept where cmpgt(m, v) says v is smaller, or larger
+//with the operands swapped, and the four left are reduced at the end
+__attribute__((target("avx2")))
+long lvec_extreme_avx2(long* x, int n, int max) {
+  if(n < 4) { return max ? lvec_max_scalar(x, n) : lvec_min_scalar(x, n); }
+
+  __m256i m = _mm256_loadu_si256((__m256i*)x);
+  int i = 4;
+  for(; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(x + i));
+    __m256i take = max ? _mm256_cmpgt_epi64(v, m) : _mm256_cmpgt_epi64(m, v);
+    m = _mm256_blendv_epi8(m, v, take);
+  }
+
+  long lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, m);
+  long r = max ? lvec_max_scalar(lanes, 4) : lvec_min_scalar(lanes, 4);
+  for(; i < n; i++) {
+    if(max ? x[i] > r : x[i] < r) { r = x[i]; }
+  }
+  return r;
+}
+
+__attribute__((target("avx2")))
+long lvec_min_avx2(long* x, int n) { return lvec_extreme_avx2(x, n, 0); }
+
+__attribute__((target("avx2")))
+long lvec_max_avx2(long* x, int n) { return lvec_extreme_avx2(x, n, 1); }
+
+lvec_kernels lvec_avx2 = {
+  "avx2",
+  lvec_add_avx2, lvec_mul_avx2, lvec_sum_avx2,
+  lvec_dot_avx2, lvec_min_avx2, lvec_max_avx2
+};
+#endif
+
+lvec_kernels* lvec_k = &lvec_scalar;
+
+//Pick the kernels, unless simd is 0
+void lvec_init(int simd) {
+  lvec_k = &lvec_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if(!simd) { return; }
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    lvec_k = &lvec_avx2;
+  } else if(__builtin_cpu_supports("sse2")) {
+    lvec_k = &lvec_sse2;
+  }
+#endif
+}
+
+//(vec 1 2 3) or (vec l), where l is a list or range of numbers
+lval* builtin_vec(lenv* e, lval* a) {
+  lval* l = a;
+  if(a->count == 1 && (ltype(a->cell[0]) == LVAL_QEXPR
+    || ltype(a->cell[0]) == LVAL_RANGE)) {
+    l = a->cell[0];
+  }
+
+  long n = lval_list_len(l);
+  LASSERT(a, n <= INT_MAX,
+    "Function 'vec' passed a list of %li items, too long for a vector.", n);
+
+  if(ltype(l) == LVAL_RANGE) {
+    lvec* b = lvec_new(n);
+    for(long i = 0; i < n; i++) { b->data[i] = lrange_at(l, i); }
+    lval_del(a);
+    return lval_vec(b);
+  }
+
+  for(int i = 0; i < l->count; i++) {
+    LASSERT(a, ltype(l->cell[i]) == LVAL_NUM,
+      "Function 'vec' passed %s at %i, Expected %s.",
+      ltype_name(ltype(l->cell[i])), i, ltype_name(LVAL_NUM));
+  }
+
+  lvec* b = lvec_new(l->count);
+  for(int i = 0; i < l->count; i++) { b->data[i] = lnum(l->cell[i]); }
+  lval_del(a);
+  return lval_vec(b);
+}
+
+lval* builtin_vec_list(lenv* e, lval* a) {
+  LASSERT_NUM("vec-list", a, 1);
+  LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
+
+  lvec* b = a->cell[0]->vec;
+  lval* x = lval_qexpr();
+  if(b->len) { x = lval_grow(x, b->len); }
+  for(int i = 0; i < b->len; i++) { x = lval_add(x, lval_num(b->data[i])); }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vec_len(lenv* e, lval* a) {
+  LASSERT_NUM("vec-len", a, 1);
+  LASSERT_TYPE("vec-len", a, 0, LVAL_VEC);
+
+  long n = a->cell[0]->vec->len;
+  lval_del(a);
+  return lval_num(n);
+}
+
+lval* builtin_vec_ref(lenv* e, lval* a) {
+  LASSERT_NUM("vec-ref", a, 2);
+  LASSERT_TYPE("vec-ref", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vec-ref", a, 1, LVAL_NUM);
+
+  lvec* b = a->cell[0]->vec;
+  long i = lnum(a->cell[1]);
+  LASSERT(a, i >= 0 && i < b->len,
+    "Function 'vec-ref' passed index %li for a vector of %i items.", i, b->len);
+
+  long x = b->data[i];
+  lval_del(a);
+  return lval_num(x);
+}
+
+//Vector of op applied to the items of two vectors of the same length
+lval* lval_vec_zip(lval* a, char* func,
+  void (*op)(long* r, long* x, long* y, int n)) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_VEC);
+  LASSERT_TYPE(func, a, 1, LVAL_VEC);
+
+  lvec* x = a->cell[0]->vec;
+  lvec* y = a->cell[1]->vec;
+  LASSERT(a, x->len == y->len,
+    "Function '%s' passed vectors of %i and %i items.", func, x->len, y->len);
+
+  lvec* r = lvec_new(x->len);
+  op(r->data, x->data, y->data, x->len);
+  lval_del(a);
+  return lval_vec(r);
+}
+
+lval* builtin_vec_add(lenv* e, lval* a) {
+  return lval_vec_zip(a, "vec+", lvec_k->add);
+}
+
+lval* builtin_vec_mul(lenv* e, lval* a) {
+  return lval_vec_zip(a, "vec*", lvec_k->mul);
+}
+
+lval* builtin_vec_sum(lenv* e, lval* a) {
+  LASSERT_NUM("vec-sum", a, 1);
+  LASSERT_TYPE("vec-sum", a, 0, LVAL_VEC);
+
+  lvec* x = a->cell[0]->vec;
+  long r = lvec_k->sum(x->data, x->len);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_vec_dot(lenv* e, lval* a) {
+  LASSERT_NUM("vec-dot", a, 2);
+  LASSERT_TYPE("vec-dot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vec-dot", a, 1, LVAL_VEC);
+
+  lvec* x = a->cell[0]->vec;
+  lvec* y = a->cell[1]->vec;
+  LASSERT(a, x->len == y->len,
+    "Function 'vec-dot' passed vectors of %i and %i items.", x->len, y->len);
+
+  long r = lvec_k->dot(x->data, y->data, x->len);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* lval_vec_extreme(lval* a, char* func, long (*op)(long* x, int n)) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_VEC);
+
+  lvec* x = a->cell[0]->vec;
+  LASSERT(a, x->len > 0, "Function '%s' passed an empty vector.", func);
+
+  long r = op(x->data, x->len);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_vec_min(lenv* e, lval* a) {
+  return lval_vec_extreme(a, "vec-min", lvec_k->min);
+}
+
+lval* builtin_vec_max(lenv* e, lval* a) {
+  return lval_vec_extreme(a, "vec-max", lvec_k->max);
 }
 
 /** =================
-Beginning of builtin
+End of Vectors
 ===================== */
 
+//Builtins that read ranges as they are, or only pass them on. Any other
+//builtin is given ranges made into lists.
+lbuiltin lrange_lazy[] = {
+  builtin_def, builtin_put, builtin_eq, builtin_ne,
+  builtin_head, builtin_tail, builtin_range,
+  builtin_len, builtin_nth, builtin_last,
+  builtin_fst, builtin_snd, builtin_trd,
+  builtin_map, builtin_filter, builtin_foldl, builtin_foldr, builtin_pmap,
+  builtin_vec, NULL
+};
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-  //TODO: Assert type
-
-  lval* syms = a->cell[0];
-  for(int i = 0; i <syms->count; i++){
-    //TODO: Assert symbols
+//Whether any of the arguments a is a range
+int lval_ranges(lval* a) {
+  for(int i = 0; i < a->count; i++) {
+    if(ltype(a->cell[i]) == LVAL_RANGE) { return 1; }
   }
+  return 0;
+}
 
-  //TODO: Assert passed arguments
+//Arguments a with their ranges made into lists, or the first error
+lval* lval_force_args(lval* a) {
+  a = lval_unshare(a);
+  lval_detach(a);
+  for(int i = 0; i < a->count; i++) {
+    a->cell[i] = lval_force(a->cell[i]);
+    if(ltype(a->cell[i]) == LVAL_ERR) { return lval_take(a, i); }
+  }
+  return a;
+}
 
-  for(int i = 0; i < syms->count; i++) {
-    if(strcmp(func, "def") == 0) {
-      lenv_def(e, syms->cell[i], a->cell[i+1]);
+//Call builtin b with arguments a
+lval* lval_builtin(lenv* e, lbuiltin b, lval* a) {
+  if(lval_ranges(a)) {
+    int lazy = 0;
+    for(int i = 0; lrange_lazy[i]; i++) {
+      if(lrange_lazy[i] == b) { lazy = 1; }
     }
 
-    if(strcmp(func, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i+1]);
+    if(!lazy) {
+      a = lval_force_args(a);
+      if(ltype(a) == LVAL_ERR) { return a; }
     }
   }
 
-  lval_del(a);
-  return lval_sexpr();
+  return b(e, a);
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-  return builtin_var(e, a, "def");
-}
+/** =================
+Beginning of Constant Folding
+===================== */
 
-lval* builtin_put(lenv* e, lval* a) {
-  return builtin_var(e, a, "=");
-}
+//With --fold, expressions are scanned after they are read, and any call
+//of a pure builtin on constants is evaluated once. The value is cached
+//on the expression's store and used whenever the expression is evaluated
+//again, as long as the builtin is still bound to the same name.
+
+int lfold_enabled = 0;
+
+//Builtins whose result depends on nothing but their arguments
+lbuiltin lfold_pure[] = {
+  builtin_add, builtin_minus, builtin_multi, builtin_div,
+  builtin_mod, builtin_pow, builtin_min, builtin_max,
+  builtin_checked_add, builtin_checked_minus, builtin_checked_multi,
+  builtin_checked_div, builtin_checked_pow,
+  builtin_lt, builtin_gt, builtin_le, builtin_ge, builtin_eq, builtin_ne,
+  builtin_list, builtin_head, builtin_tail, builtin_join, builtin_len,
+  builtin_range, builtin_vec, builtin_vec_list, builtin_vec_len,
+  builtin_vec_ref, builtin_vec_add, builtin_vec_mul, builtin_vec_sum,
+  builtin_vec_dot, builtin_vec_min, builtin_vec_max,
+  NULL
+};
 
-lval* builtin_lambda(lenv* e, lval* a) {
-  //TODO: Assert num
-  //TODO: Assert types
+int lfold_pure_fn(lbuiltin b) {
+  for(int i = 0; lfold_pure[i]; i++) {
+    if(lfold_pure[i] == b) { return 1; }
+  }
+  return 0;
+}
 
-  for(int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-      "Cannot define non-symbol, Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+//Folded value of expression v, or NULL. When globals have changed since
+//the fold was last checked, it only holds if its builtin and those of
+//the expressions it was folded from are still bound where they were.
+lval* lval_folded(lval* v) {
+  lcells* s = v->store;
+  if(!s || !s->folded || lval_worker) { return NULL; }
+  if(v->cell != s->items || v->count != s->count) { return NULL; }
+  if(s->version == lenv_version) { return s->folded; }
+
+  lval* f = lval_cached(v->cell[0]);
+  int ok = f && ltype(f) == LVAL_FUN && f->builtin == s->fn;
+  for(int i = 1; ok && i < v->count; i++) {
+    if(ltype(v->cell[i]) == LVAL_SEXPR && !lval_folded(v->cell[i])) { ok = 0; }
   }
 
-  lval* formals = lval_pop(a, 0);
-  lval* body = lval_pop(a, 0);
-  lval_del(a);
-  return lval_lambda(formals, body);
+  if(!ok) {
+    lval_del(s->folded);
+    s->folded = NULL;
+    return NULL;
+  }
+  s->version = lenv_version;
+  return s->folded;
 }
 
-lval* builtin_head(lenv* e, lval *a) {
-  LASSERT(a, a->count == 1,
-    "Function 'head' passed too many arguments. "
-    "Got %i, Expected %i.",
-    a->count, 1);
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-    "Function 'head' passed incorrect type");
-  LASSERT(a, a->cell[0]->count != 0,
-    "Function 'head' passed {}");
+//Carry the fold of v over to x, a copy of it with a store of its own
+void lfold_move(lval* v, lval* x) {
+  lcells* s = v->store;
+  if(!s->folded || v->cell != s->items || v->count != s->count) { return; }
 
-  lval* v = lval_take(a, 0);
-  while(v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
+  x->store->folded = lval_move(s->folded, x->store->pool);
+  x->store->fn = s->fn;
+  x->store->version = s->version;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-  LASSERT(a, a->count == 1,
-    "Function 'tail' passed too many arguments");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-    "Function 'tail' passed incorrect type");
-  LASSERT(a, a->cell[0]->count != 0,
-    "Function 'tail' passed {}!");
+//Evaluate the items of v as a call, if they call a pure builtin on
+//constants, and cache the value
+int lfold_call(lenv* e, lval* v) {
+  lcells* s = v->store;
+  if(v->count == 0 || v->cell != s->items || v->count != s->count) { return 0; }
+  if(ltype(v->cell[0]) != LVAL_SYM) { return 0; }
 
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
-}
+  lval* f = lval_cached(v->cell[0]);
+  if(!f || ltype(f) != LVAL_FUN || !lfold_pure_fn(f->builtin)) { return 0; }
 
-lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
-}
+  lval* a = lval_grow(lval_sexpr(), v->count - 1);
+  for(int i = 1; i < v->count; i++) {
+    lval* x = v->cell[i];
+    a = lval_add(a, lval_copy(ltype(x) == LVAL_SEXPR ? x->store->folded : x));
+  }
 
-lval* builtin_eval(lenv* e, lval* a) {
-  LASSERT(a, a->count == 1,
-    "Function 'eval' passed too many arguments");
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+  //Errors are left for the expression to raise when it runs
+  lval* r = lval_builtin(e, f->builtin, a);
+  if(ltype(r) == LVAL_ERR) {
+    lval_del(r);
+    return 0;
+  }
 
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  if(s->folded) { lval_del(s->folded); }
+  s->folded = lval_move(r, s->pool);
+  s->fn = f->builtin;
+  s->version = lenv_version;
+  lval_del(r);
+  return 1;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-  for(int i = 0; i < a->count; i++) {
-    LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-      "Function 'join' passed incorrect type");
-  }
-  
-  lval* x = lval_pop(a, 0);
-  
-  while(a->count) {
-    x = lval_join(e, x, lval_pop(a, 0));
+//Fold what can be folded in v, returning whether v is a constant. The
+//contents of Q-Expressions are folded too, since they may be evaluated
+//later as function bodies or branches, but a Q-Expression is a constant
+//either way.
+int lval_fold(lenv* e, lval* v) {
+  int type = ltype(v);
+  if(type == LVAL_SYM) { return 0; }
+  if(type != LVAL_SEXPR && type != LVAL_QEXPR) { return 1; }
+
+  int args = 1;
+  for(int i = 0; i < v->count; i++) {
+    if(!lval_fold(e, v->cell[i]) && i > 0) { args = 0; }
   }
 
-  lval_del(a);
-  return x;
+  int folded = args && lfold_call(e, v);
+  return type == LVAL_QEXPR || folded;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  
-  //Confirm all are numbers
-  for (int i = 0; i < a->count; i++) {
-    if(a->cell[i]->type != LVAL_NUM) {
-      lval_del(a);
-      return lval_err("Cannot operate on non-number");
-    }
-  }
+/** =================
+End of Constant Folding
+===================== */
 
-  lval* x = lval_pop(a, 0);
+/** =================
+Beginning of Memoization
+===================== */
 
-  if((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
-  }
+//(memo f) is lambda f with a table of the results it has returned, keyed
+//by the list of arguments. Keys are found by a structural hash and
+//compared with lval_eq, so equal lists hit whichever nodes hold them.
+//Entries and their keys are kept in the heap, which lets a table be
+//shared by every copy of the function wherever they live. With a limit
+//on entries, the least recently used one makes way for a new one.
+
+typedef struct lmemo_entry {
+  struct lmemo_entry* next;
+  struct lmemo_entry* newer;
+  struct lmemo_entry* older;
+  unsigned long hash;
+  lval* args;
+  lval* val;
+} lmemo_entry;
+
+//Buckets are chained, and entries are also linked newest to oldest
+//through a ring headed by lru
+struct lmemo {
+  int refs;
+  int count;
+  int max;
+  int mask;
+  lmemo_entry** buckets;
+  lmemo_entry lru;
+  long hits;
+  long misses;
+  long evictions;
+};
 
-  while(a->count > 0) {
+unsigned long lval_hash_num(long n) {
+  return ((14695981039346656037UL ^ LVAL_NUM) ^ (unsigned long)n) * 1099511628211UL;
+}
 
-    lval* y = lval_pop(a, 0);
-    
-    if(strcmp(op, "+") == 0) { x->num += y->num; }
-    if(strcmp(op, "-") == 0) { x->num -= y->num; }
-    if(strcmp(op, "*") == 0) { x->num *= y->num; }
-    if(strcmp(op, "/") == 0) {
-      if(y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division By Zero");
-      } else {
-        x->num /= y->num;
-      }
-    }
+unsigned long lval_hash(lval* v) {
+  unsigned long h = 14695981039346656037UL ^ ltype(v);
 
-    //TODO: Add lval stuff
-    if(strcmp(op, "%") == 0) { 
-      return y->num == 0
-        ? lval_err("Modulo By Zero")
-        : lval_num(x->num % y->num);
-    }
-    if(strcmp(op, "^") == 0) { 
-      long val = x->num;
-      for(int i = 1; i < y->num; i++){
-        val = val * x->num;
+  switch(ltype(v)) {
+    case LVAL_NUM: return lval_hash_num(lnum(v));
+    case LVAL_ERR:
+    case LVAL_STR: {
+      lstr* s = ltype(v) == LVAL_STR ? v->str : v->err;
+      for(int i = 0; i < s->len; i++) {
+        h = (h ^ (unsigned char)s->data[i]) * 1099511628211UL;
       }
-      return lval_num(val);
     }
-    if(strcmp(op, "min") == 0) { return lval_num(x->num > y->num ? y->num : x->num); }
-    if(strcmp(op, "max") == 0) { return lval_num(x->num < y->num ? y->num : x->num); }
-
-    lval_del(y);
+    break;
+    case LVAL_SYM: h ^= v->sym->hash; break;
+    case LVAL_VEC:
+      for(int i = 0; i < v->vec->len; i++) {
+        h = (h ^ (unsigned long)v->vec->data[i]) * 1099511628211UL;
+      }
+    break;
+    case LVAL_FUN:
+      //Lambdas equal by lval_eq may have different frames, so only the
+      //body is hashed
+      h ^= v->builtin ? (uintptr_t)v->builtin : lval_hash(v->body);
+    break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for(int i = 0; i < v->count; i++) {
+        h = (h ^ lval_hash(v->cell[i])) * 1099511628211UL;
+      }
+    break;
+    //The same as the list it equals
+    case LVAL_RANGE:
+      h = 14695981039346656037UL ^ LVAL_QEXPR;
+      for(long i = 0; i < v->length; i++) {
+        h = (h ^ lval_hash_num(lrange_at(v, i))) * 1099511628211UL;
+      }
+    break;
   }
-  lval_del(a);
-  return x;
+  return h * 1099511628211UL;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+lmemo* lmemo_new(int max) {
+  lmemo* m = malloc(sizeof(lmemo));
+  m->refs = 1;
+  m->count = 0;
+  m->max = max;
+  m->mask = 15;
+  m->buckets = calloc(m->mask + 1, sizeof(lmemo_entry*));
+  m->lru.newer = m->lru.older = &m->lru;
+  m->hits = 0;
+  m->misses = 0;
+  m->evictions = 0;
+  return m;
 }
 
-lval* builtin_minus(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+lmemo* lmemo_copy(lmemo* m) {
+  m->refs++;
+  return m;
 }
 
-lval* builtin_multi(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+void lmemo_free(lmemo* m) {
+  for(lmemo_entry* x = m->lru.older; x != &m->lru;) {
+    lmemo_entry* older = x->older;
+    free(x);
+    x = older;
+  }
+  free(m->buckets);
+  free(m);
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+void lmemo_del(lmemo* m) {
+  if(--m->refs > 0) { return; }
+
+  for(lmemo_entry* x = m->lru.older; x != &m->lru; x = x->older) {
+    lval_del(x->args);
+    lval_del(x->val);
+  }
+  lmemo_free(m);
 }
 
-lval* builtin_exit(lenv* e, lval* a){
-  REPL = 0;
-  return a;
+void lmemo_mark(lmemo* m) {
+  for(lmemo_entry* x = m->lru.older; x != &m->lru; x = x->older) {
+    lgc_mark(x->args);
+    lgc_mark(x->val);
+  }
 }
 
-/** =================
-Beginning of builtin Conditionals
-===================== */
+void lmemo_unref(lmemo* m) {
+  if(--m->refs > 0) { return; }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+  for(lmemo_entry* x = m->lru.older; x != &m->lru; x = x->older) {
+    lgc_unref(x->args);
+    lgc_unref(x->val);
+  }
+  lmemo_free(m);
+}
 
-  int r;
+void lmemo_unlink(lmemo_entry* x) {
+  x->newer->older = x->older;
+  x->older->newer = x->newer;
+}
 
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
+void lmemo_link(lmemo* m, lmemo_entry* x) {
+  x->older = m->lru.older;
+  x->newer = &m->lru;
+  m->lru.older->newer = x;
+  m->lru.older = x;
+}
+
+void lmemo_evict(lmemo* m) {
+  lmemo_entry* x = m->lru.newer;
+  lmemo_entry** p = &m->buckets[x->hash & m->mask];
+  while(*p != x) { p = &(*p)->next; }
+  *p = x->next;
+
+  lmemo_unlink(x);
+  lval_del(x->args);
+  lval_del(x->val);
+  free(x);
+  m->count--;
+  m->evictions++;
+}
+
+void lmemo_grow(lmemo* m) {
+  int mask = m->mask * 2 + 1;
+  lmemo_entry** buckets = calloc(mask + 1, sizeof(lmemo_entry*));
+  for(lmemo_entry* x = m->lru.older; x != &m->lru; x = x->older) {
+    x->next = buckets[x->hash & mask];
+    buckets[x->hash & mask] = x;
   }
-  if(strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
+  free(m->buckets);
+  m->buckets = buckets;
+  m->mask = mask;
+}
+
+//The call may redefine the name f was bound to, so f and its table are
+//held until the result is stored
+lval* lmemo_call(lenv* e, lval* f, lval* a) {
+  lmemo* m = f->memo;
+  unsigned long h = lval_hash(a);
+
+  for(lmemo_entry* x = m->buckets[h & m->mask]; x; x = x->next) {
+    if(x->hash == h && lval_eq(x->args, a)) {
+      lmemo_unlink(x);
+      lmemo_link(m, x);
+      m->hits++;
+      lval_del(a);
+      return lval_copy(x->val);
+    }
   }
-  if(strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
+  m->misses++;
+
+  f = lval_copy(f);
+  lmemo_copy(m);
+  lval* args = lval_move(a, 0);
+  lval* r;
+  lenv* frame = lval_frame(e, f, a, &r);
+  if(frame) { r = lval_enter(f, frame); }
+
+  //Partial applications are not results, and errors may not be the
+  //same next time, with a different depth limit
+  if(!frame || ltype(r) == LVAL_ERR) {
+    lval_del(args);
+    lmemo_del(m);
+    lval_del(f);
+    return r;
   }
-  if(strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
+
+  //The call may have filled the table with the same key already
+  for(lmemo_entry* x = m->buckets[h & m->mask]; x; x = x->next) {
+    if(x->hash == h && lval_eq(x->args, args)) {
+      lval_del(args);
+      lmemo_del(m);
+      lval_del(f);
+      return r;
+    }
   }
 
-  lval_del(a);
-  return lval_num(r);
+  if(m->max && m->count >= m->max) { lmemo_evict(m); }
+  if(m->count > m->mask) { lmemo_grow(m); }
+
+  lmemo_entry* x = malloc(sizeof(lmemo_entry));
+  x->hash = h;
+  x->args = args;
+  x->val = lval_move(r, 0);
+  x->next = m->buckets[h & m->mask];
+  m->buckets[h & m->mask] = x;
+  lmemo_link(m, x);
+  m->count++;
+  lmemo_del(m);
+  lval_del(f);
+  return r;
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<");
-}
+//(memo f) or (memo f max), where a max of 0 means no limit
+lval* builtin_memo(lenv* e, lval* a) {
+  LASSERT_NUM_BETWEEN("memo", a, 1, 2);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+  LASSERT(a, !a->cell[0]->builtin,
+    "Function 'memo' passed a builtin. Only lambdas can be memoized.");
+
+  int max = 0;
+  if(a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    LASSERT(a, lnum(a->cell[1]) >= 0 && lnum(a->cell[1]) <= INT_MAX,
+      "Function 'memo' passed invalid max entries %li.", lnum(a->cell[1]));
+    max = lnum(a->cell[1]);
+  }
 
-lval* builtin_gt(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">");
+  lval* f = lval_unshare(lval_take(a, 0));
+  if(f->memo) { lmemo_del(f->memo); }
+  f->memo = lmemo_new(max);
+  return f;
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<=");
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+  lmemo* m = a->cell[0]->builtin ? NULL : a->cell[0]->memo;
+  LASSERT(a, m, "Function 'memo-stats' passed a function that is not memoized.");
+
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_sym("hits"));
+  x = lval_add(x, lval_num(m->hits));
+  x = lval_add(x, lval_sym("misses"));
+  x = lval_add(x, lval_num(m->misses));
+  x = lval_add(x, lval_sym("entries"));
+  x = lval_add(x, lval_num(m->count));
+  x = lval_add(x, lval_sym("evictions"));
+  x = lval_add(x, lval_num(m->evictions));
+  x = lval_add(x, lval_sym("max"));
+  x = lval_add(x, lval_num(m->max));
+  lval_del(a);
+  return x;
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">=");
-}
+/** =================
+End of Memoization
+===================== */
 
+/** =================
+Beginning of Parallel Map
+===================== */
 
-int lval_eq(lval* x, lval* y) {
-  //Confirm all are numbers
-  if(x->type != y->type) { return 0; }
+//(pmap f l) is (map f l) with the calls spread over a pool of worker
+//threads, one per core, started the first time it runs. Workers take
+//items in turn and evaluate them in arenas of their own above the
+//caller's, reading the caller's nodes and environments, which lead up
+//to the global one, without changing them: no references are counted
+//on them, and caches, memo tables and compiled code are left alone.
+//Workers run the tree walker and cannot def or load. Once every item
+//is done the caller moves the results into its own pool, and only then
+//are the workers told to release their arenas.
+
+enum { LPMAP_RUN, LPMAP_RELEASE };
+
+typedef struct lpmap {
+  lval* f;
+  lval* l;
+  lenv* env;
+  long n;
+  long next;
+  int failed;
+  int floor;
+  lval** results;
+} lpmap;
+
+//Workers to start, or 0 for one per core
+int lpmap_size = 0;
+int lpmap_workers = 0;
+
+#ifndef _WIN32
+pthread_mutex_t lpmap_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lpmap_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t lpmap_done = PTHREAD_COND_INITIALIZER;
+int lpmap_pending = 0;
+unsigned lpmap_generation = 0;
+int lpmap_phase;
+lpmap* lpmap_job;
+
+//Environment calls are made in, so = binds there and not in the caller's
+__thread lenv* lpmap_env = NULL;
+
+void lpmap_run(lpmap* j) {
+  lval_floor = j->floor;
+  lval_nesting = lval_depth = j->floor;
+  lval_arena_begin();
+
+  lpmap_env = lenv_new();
+  lpmap_env->par = j->env;
+
+  while(!__atomic_load_n(&j->failed, __ATOMIC_RELAXED)) {
+    long i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+    if(i >= j->n) { break; }
+
+    lval* x = lval_list_item(lpmap_env, j->l, i);
+    if(ltype(x) != LVAL_ERR) {
+      x = lval_call(lpmap_env, j->f, lval_add(lval_sexpr(), x));
+    }
+    if(ltype(x) == LVAL_ERR) {
+      __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+    }
+    j->results[i] = x;
+  }
+}
 
-  switch (x->type) {
-    case LVAL_NUM: return (x->num == y->num);
+void lpmap_release(void) {
+  lenv_del(lpmap_env);
+  lpmap_env = NULL;
+  lval_arena_end();
+}
 
-    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, x->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, x->str) == 0);
+void* lpmap_worker(void* arg) {
+  lval_worker = 1;
+  lval_stack_begin();
+  unsigned seen = 0;
 
+  pthread_mutex_lock(&lpmap_lock);
+  while(1) {
+    while(lpmap_generation == seen) {
+      pthread_cond_wait(&lpmap_wake, &lpmap_lock);
+    }
+    seen = lpmap_generation;
+    int phase = lpmap_phase;
+    lpmap* j = lpmap_job;
+    pthread_mutex_unlock(&lpmap_lock);
 
-    case LVAL_FUN:
-      if(x->builtin || y->builtin) {
-        return x->builtin == y->builtin;
-      } else {
-        return lval_eq(x->formals, y->formals)
-          && lval_eq(x->body, y->body);
-      }
+    if(phase == LPMAP_RUN) {
+      lpmap_run(j);
+    } else {
+      lpmap_release();
+    }
 
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      if(x->count != y->count) { return 0; }
-      for(int i = 0; i < x->count; i++) {
-        if(!lval_eq(x->cell[i], y->cell[i])) {return 0;}
-      }
-      return 1;
-    break;
+    pthread_mutex_lock(&lpmap_lock);
+    if(--lpmap_pending == 0) { pthread_cond_signal(&lpmap_done); }
   }
-  
-  return 0;
+  return NULL;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-
-  int r;
-  if(strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
-  }
-  if(strcmp(op, "!=") == 0){
-    r = !lval_eq(a->cell[0], a->cell[1]);
+//Start the pool, returning how many workers it has
+int lpmap_start(void) {
+  if(lpmap_workers) { return lpmap_workers; }
+
+  long n = lpmap_size ? lpmap_size : sysconf(_SC_NPROCESSORS_ONLN);
+  if(n < 1) { n = 1; }
+
+  //Workers get a stack the size the depth check expects
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, lval_stack_size);
+  for(long i = 0; i < n; i++) {
+    pthread_t t;
+    if(pthread_create(&t, &attr, lpmap_worker, NULL) != 0) { break; }
+    pthread_detach(t);
+    lpmap_workers++;
   }
-  lval_del(a);
-  return lval_num(r);
+  pthread_attr_destroy(&attr);
+  return lpmap_workers;
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "==");
+//Have every worker carry out phase of job j, and wait for them all
+void lpmap_dispatch(lpmap* j, int phase) {
+  pthread_mutex_lock(&lpmap_lock);
+  lpmap_job = j;
+  lpmap_phase = phase;
+  lpmap_pending = lpmap_workers;
+  lpmap_generation++;
+  pthread_cond_broadcast(&lpmap_wake);
+  while(lpmap_pending) { pthread_cond_wait(&lpmap_done, &lpmap_lock); }
+  pthread_mutex_unlock(&lpmap_lock);
 }
-
-lval* builtin_ne(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "!=");
+#else
+//Without threads there is no pool, and pmap is map
+int lpmap_start(void) {
+  return 0;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-  LASSERT_NUM("if", a, 3);
-  LASSERT_TYPE("if", a, 0, LVAL_NUM);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+void lpmap_dispatch(lpmap* j, int phase) {}
+#endif
 
-  lval* x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+lval* builtin_pmap(lenv* e, lval* a) {
+  LASSERT_NUM("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_LIST("pmap", a, 1);
 
-  if(a->cell[0]->num) {
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    x = lval_eval(e, lval_pop(a, 2));
+  //Inside a worker, or with no arena left to give workers, it is a map
+  long n = lval_list_len(a->cell[1]);
+  if(lval_worker || n < 2 || lval_nesting + 1 >= LPOOL_DEPTH
+    || !lpmap_start()) {
+    return builtin_map(e, a);
+  }
+  LASSERT(a, n <= INT_MAX,
+    "Function 'pmap' passed a list of %li items, too long for a result.", n);
+
+  lpmap j;
+  j.f = a->cell[0];
+  j.l = a->cell[1];
+  j.env = e;
+  j.n = n;
+  j.next = 0;
+  j.failed = 0;
+  j.floor = lval_depth;
+  j.results = calloc(n, sizeof(lval*));
+
+  lpmap_dispatch(&j, LPMAP_RUN);
+
+  //Items are taken in order, so every one before the first error is done
+  lval* r = NULL;
+  for(long i = 0; i < n && !r; i++) {
+    if(j.results[i] && ltype(j.results[i]) == LVAL_ERR) {
+      r = lval_move(j.results[i], lval_depth);
+    }
+  }
+  if(!r) {
+    r = lval_grow(lval_qexpr(), n);
+    for(long i = 0; i < n; i++) {
+      r = lval_add(r, lval_move(j.results[i], lval_depth));
+    }
   }
 
+  lpmap_dispatch(&j, LPMAP_RELEASE);
+  free(j.results);
   lval_del(a);
-  return x;
+  return r;
 }
 
 /** =================
-End of builtin Conditionals
+End of Parallel Map
 ===================== */
 
 
+//An optional second argument picks the evaluator, "vm" or "tree"
 lval* builtin_load(lenv* e, lval* a) {
-  LASSERT_NUM("load", a, 1);
+  LASSERT_NUM_BETWEEN("load", a, 1, 2);
   LASSERT_TYPE("load", a, 0, LVAL_STR);
+  LASSERT(a, !lval_worker, "Function 'load' cannot be used inside pmap.");
+
+  int vm = lvm_enabled;
+  if(a->count == 2) {
+    LASSERT_TYPE("load", a, 1, LVAL_STR);
+    char* mode = a->cell[1]->str->data;
+    LASSERT(a, strcmp(mode, "vm") == 0 || strcmp(mode, "tree") == 0,
+      "Function 'load' passed unknown mode '%s'", mode);
+    vm = strcmp(mode, "vm") == 0;
+  }
 
   mpc_result_t r;
-  if(mpc_parse_contents(a->cell[0]->str, Risky, &r)) {
+  if(mpc_parse_contents(a->cell[0]->str->data, Risky, &r)) {
     lval* expr = lval_read(r.output);
     mpc_ast_delete(r.output);
+    if(lfold_enabled) { lval_fold(e, expr); }
+
+    int was = lvm_enabled;
+    lvm_enabled = vm;
 
+    lgc_push_root(a);
+    lgc_push_root(expr);
     while(expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
+      lval_arena_begin();
+      lval* x = lval_run(e, lval_pop(expr, 0));
 
-      if(x->type == LVAL_ERR) { lval_println(x); }
+      if(ltype(x) == LVAL_ERR) { lval_println(x); }
       lval_del(x);
+      lval_arena_end();
+      lgc_maybe();
     }
+    lgc_pop_root();
+    lgc_pop_root();
+    lvm_enabled = was;
 
     lval_del(expr);
     lval_del(a);
@@ -960,11 +4240,40 @@ lval* builtin_error(lenv* e, lval* a) {
   LASSERT_NUM("error", a, 1);
   LASSERT_TYPE("error", a, 0, LVAL_STR);
 
-  lval* err = lval_err(a->cell[0]->str);
+  lval* err = lval_err_str(a->cell[0]);
   lval_del(a);
   return err;
 }
 
+//Collections only happen between top-level expressions, so this just
+//asks for one at the next opportunity
+lval* builtin_gc(lenv* e, lval* a) {
+  LASSERT_NUM("gc", a, 0);
+  lgc_requested = 1;
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_gc_stats(lenv* e, lval* a) {
+  LASSERT_NUM("gc-stats", a, 0);
+  lval_del(a);
+
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_sym("collections"));
+  x = lval_add(x, lval_num(lgc_collections));
+  x = lval_add(x, lval_sym("freed"));
+  x = lval_add(x, lval_num(lgc_freed));
+  x = lval_add(x, lval_sym("live"));
+  x = lval_add(x, lval_num(lgc_live));
+  x = lval_add(x, lval_sym("heap"));
+  x = lval_add(x, lval_num(lgc_heap_bytes));
+  x = lval_add(x, lval_sym("heap-size"));
+  x = lval_add(x, lval_num(lgc_heap_size));
+  x = lval_add(x, lval_sym("threshold"));
+  x = lval_add(x, lval_num(lgc_threshold));
+  return x;
+}
+
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
   lval* k = lval_sym(name);
   lval* v = lval_fun(func);
@@ -985,6 +4294,13 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "print",  builtin_print);
   lenv_add_builtin(e, "error",  builtin_error);
 
+  //Memory
+  lenv_add_builtin(e, "gc", builtin_gc);
+  lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+  lenv_add_builtin(e, "memo", builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+  lenv_add_builtin(e, "pmap", builtin_pmap);
+
   //Conditionals
   lenv_add_builtin(e, "<",  builtin_lt);
   lenv_add_builtin(e, ">",  builtin_gt);
@@ -1006,6 +4322,29 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "-", builtin_minus);
   lenv_add_builtin(e, "*", builtin_multi);
   lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_builtin(e, "%", builtin_mod);
+  lenv_add_builtin(e, "^", builtin_pow);
+  lenv_add_builtin(e, "min", builtin_min);
+  lenv_add_builtin(e, "max", builtin_max);
+
+  //Math fn reporting overflow instead of wrapping
+  lenv_add_builtin(e, "checked+", builtin_checked_add);
+  lenv_add_builtin(e, "checked-", builtin_checked_minus);
+  lenv_add_builtin(e, "checked*", builtin_checked_multi);
+  lenv_add_builtin(e, "checked/", builtin_checked_div);
+  lenv_add_builtin(e, "checked^", builtin_checked_pow);
+
+  //Vector Functions
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "vec-list", builtin_vec_list);
+  lenv_add_builtin(e, "vec-len", builtin_vec_len);
+  lenv_add_builtin(e, "vec-ref", builtin_vec_ref);
+  lenv_add_builtin(e, "vec+", builtin_vec_add);
+  lenv_add_builtin(e, "vec*", builtin_vec_mul);
+  lenv_add_builtin(e, "vec-sum", builtin_vec_sum);
+  lenv_add_builtin(e, "vec-dot", builtin_vec_dot);
+  lenv_add_builtin(e, "vec-min", builtin_vec_min);
+  lenv_add_builtin(e, "vec-max", builtin_vec_max);
 
 }
 
@@ -1027,6 +4366,9 @@ void lenv_add_std(mpc_parser_t* Risky, lenv* e, char* input) {
   }
 }
 
+//Whether the standard library uses native builtins where it has them
+int lstd_native = 1;
+
 void lenv_add_std_fns(mpc_parser_t* Risky, lenv* e) {
 
   //Macro?
@@ -1049,35 +4391,63 @@ void lenv_add_std_fns(mpc_parser_t* Risky, lenv* e) {
   lenv_add_std(Risky, e, "(fun {or x y} {+ x y})");
   lenv_add_std(Risky, e, "(fun {and x y} {* x y})");
 
-  lenv_add_std(Risky, e, "(fun {fst l} {eval (head l)})");
-  lenv_add_std(Risky, e, "(fun {snd l} {eval (head (tail l))})");
-  lenv_add_std(Risky, e, "(fun {trd l} {eval (head (tail (tail l)))})");
-  lenv_add_std(Risky, e, "(fun {len l} {if (== l nil) {0} {+ 1 (len (tail l))}})");
-  lenv_add_std(Risky, e, "(fun {nth n l} {if (== n 0) {fst l} {nth (- n 1) (tail l)}})");
-  lenv_add_std(Risky, e, "(fun {last l} {nth (- (len l) 1) l})");
-
-  lenv_add_std(Risky, e, "(fun {map f l} \
-                            {if (== l nil)    \
-                              {nil}           \
-                              {join (list (f (fst l))) (map f (tail l))}})");
-  
-  lenv_add_std(Risky, e, "(fun {filter f l} \
-                            {if (== l nil)  \
-                              {{}}         \
-                              {join         \
-                                (if (f (fst l))     \
-                                    {list (fst l)}         \
-                                    {{}})          \
-                                (filter f (tail l))}})");
-
-  lenv_add_std(Risky, e, "(fun {range start end}  \
-                            {if (> start end)    \
-                                {{}}              \
-                                {join (list start) (range (inc start) end)}})");
+  //List inspection is native unless asked for with --no-native
+  if(lstd_native) {
+    lenv_add_builtin(e, "fst", builtin_fst);
+    lenv_add_builtin(e, "snd", builtin_snd);
+    lenv_add_builtin(e, "trd", builtin_trd);
+    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "foldr", builtin_foldr);
+    lenv_add_builtin(e, "range", builtin_range);
+  } else {
+    lenv_add_std(Risky, e, "(fun {fst l} {eval (head l)})");
+    lenv_add_std(Risky, e, "(fun {snd l} {eval (head (tail l))})");
+    lenv_add_std(Risky, e, "(fun {trd l} {eval (head (tail (tail l)))})");
+    lenv_add_std(Risky, e, "(fun {len l} {if (== l nil) {0} {+ 1 (len (tail l))}})");
+    lenv_add_std(Risky, e, "(fun {nth n l} {if (== n 0) {fst l} {nth (- n 1) (tail l)}})");
+    lenv_add_std(Risky, e, "(fun {last l} {nth (- (len l) 1) l})");
+
+    lenv_add_std(Risky, e, "(fun {map f l} \
+                              {if (== l nil)    \
+                                {nil}           \
+                                {join (list (f (fst l))) (map f (tail l))}})");
+
+    lenv_add_std(Risky, e, "(fun {filter f l} \
+                              {if (== l nil)  \
+                                {{}}         \
+                                {join         \
+                                  (if (f (fst l))     \
+                                      {list (fst l)}         \
+                                      {{}})          \
+                                  (filter f (tail l))}})");
+
+    lenv_add_std(Risky, e, "(fun {foldl f z l} \
+                              {if (== l nil)  \
+                                {z}           \
+                                {foldl f (f z (fst l)) (tail l)}})");
+
+    lenv_add_std(Risky, e, "(fun {foldr f z l} \
+                              {if (== l nil)  \
+                                {z}           \
+                                {f (fst l) (foldr f z (tail l))}})");
+
+    lenv_add_std(Risky, e, "(fun {range start end}  \
+                              {if (> start end)    \
+                                  {{}}              \
+                                  {join (list start) (range (inc start) end)}})");
+  }
 }
 
 
 int main(int argc, char** argv) {
+  lval_stack_init();
+  lval_stack_begin();
+
   //Create Parsers
   Number    = mpc_new("number");
   Symbol    = mpc_new("symbol");
@@ -1091,7 +4461,7 @@ int main(int argc, char** argv) {
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                                     \
       number    : /-?[0-9]+/ ;                            \
-      symbol    : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;      \
+      symbol    : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^]+/ ;    \
       string    : /\"(\\\\.|[^\"])*\"/ ;                  \
       comment   : /;[^\\r\\n]*/ ;                         \
       sexpr     : '(' <expr>* ')' ;                       \
@@ -1102,19 +4472,54 @@ int main(int argc, char** argv) {
     ", Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Risky); 
 
 
+  lsym_amp = lsym_intern("&");
+  lsym_if = lsym_intern("if");
+
   lenv* e = lenv_new();
+  lenv_global = e;
   lenv_add_builtins(e);
 
+  //Options come first, anything else is a file to load
+  int files = 0;
+  int simd = 1;
+  for(int i = 1; i < argc; i++) {
+    if(strncmp(argv[i], "--", 2) != 0) { files++; continue; }
+
+    if(strncmp(argv[i], "--gc-threshold=", 15) == 0) {
+      lgc_threshold = atol(argv[i] + 15);
+    } else if(strncmp(argv[i], "--heap-size=", 12) == 0) {
+      lgc_heap_size = atol(argv[i] + 12);
+    } else if(strcmp(argv[i], "--vm") == 0) {
+      lvm_enabled = 1;
+    } else if(strcmp(argv[i], "--fold") == 0) {
+      lfold_enabled = 1;
+    } else if(strncmp(argv[i], "--max-depth=", 12) == 0) {
+      lval_max_depth = atoi(argv[i] + 12);
+    } else if(strncmp(argv[i], "--workers=", 10) == 0) {
+      lpmap_size = atoi(argv[i] + 10);
+    } else if(strcmp(argv[i], "--no-simd") == 0) {
+      simd = 0;
+    } else if(strcmp(argv[i], "--no-native") == 0) {
+      lstd_native = 0;
+    } else {
+      printf("Unknown option '%s'\n", argv[i]);
+      return 1;
+    }
+  }
+
+  lvec_init(simd);
   lenv_add_std_fns(Risky, e);
+  lgc_env = e;
 
-  if(argc >= 2) {
+  if(files) {
 
     for(int i = 1; i < argc; i++) {
+      if(strncmp(argv[i], "--", 2) == 0) { continue; }
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
       lval* x = builtin_load(e, args);
 
-      if(x->type == LVAL_ERR) { lval_println(x); }
+      if(ltype(x) == LVAL_ERR) { lval_println(x); }
       lval_del(x);
     }
   } else {
@@ -1132,9 +4537,14 @@ int main(int argc, char** argv) {
       mpc_result_t r;
       if(mpc_parse("<stdin>", input, Risky, &r)) {
         //On success
-        lval* x = lval_eval(e, lval_read(r.output));
+        lval_arena_begin();
+        lval* x = lval_read(r.output);
+        if(lfold_enabled) { lval_fold(e, x); }
+        x = lval_run(e, x);
         lval_println(x);
         lval_del(x);
+        lval_arena_end();
+        lgc_maybe();
         mpc_ast_delete(r.output);
       } else {
         //On error
@@ -1148,6 +4558,7 @@ int main(int argc, char** argv) {
   }
 
   lenv_del(e);
+  lsym_cleanup();
   mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Risky);
 
   return 0;
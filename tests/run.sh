@@ -0,0 +1,19 @@
+#!/bin/sh
+# Run every script in tests/ with each evaluator and compare the output
+# with the .exp file next to it. Usage: tests/run.sh path/to/risky
+risky=${1:-./risky}
+dir=$(dirname "$0")
+fail=0
+
+for t in "$dir"/*.rsky; do
+  for flags in "" "--vm" "--fold" "--workers=3"; do
+    if ! $risky $flags "$t" 2>&1 | diff -u "${t%.rsky}.exp" - > /dev/null; then
+      echo "FAIL $t $flags"
+      $risky $flags "$t" 2>&1 | diff -u "${t%.rsky}.exp" - | head -20
+      fail=1
+    fi
+  done
+done
+
+[ $fail = 0 ] && echo "All tests passed"
+exit $fail